@@ -5,6 +5,8 @@
 #define INTERPRETER_AST_HPP
 
 #include "llvm/ADT/APFloat.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Optional.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
@@ -18,382 +20,426 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Target/TargetOptions.h"
+#include <algorithm>
+#include <type_traits>
 #include <utility>
+#include <vector>
+
+#include "Codegen.hpp"
+#include "Operator.hpp"
+#include "Symbol.hpp"
 
 namespace In
 {
-    static inline llvm::LLVMContext TheContext;
-    static inline llvm::IRBuilder<> Builder(TheContext);
-    static inline std::unique_ptr<llvm::Module> TheModule;
-    static inline std::map<std::string, llvm::AllocaInst*> NamedValues;
-
-    static llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *theFunction,
-            const std::string& varName)
+    // Owns every AST node of a compilation. Nodes are bump allocated and all
+    // released at once with the arena, none is ever destroyed on its own, so
+    // they must be trivially destructible. Text in nodes views into the
+    // source buffers, which live as long as the compilation.
+    class AstArena
     {
-        llvm::IRBuilder<> tmp(&theFunction->getEntryBlock(),
-                theFunction->getEntryBlock().begin());
-        return tmp.CreateAlloca(llvm::Type::getFloatTy(TheContext), 0,
-                varName.c_str());
-    }
+    public:
+        template<typename T, typename... Args>
+        T *New(Args &&... args)
+        {
+            static_assert(std::is_trivially_destructible_v<T>,
+                          "arena nodes are never destroyed");
+            return new(_allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+        }
 
-    llvm::Value *LogErrorV(const std::string& str)
-    {
-        std::cout << str << std::endl;
-        return nullptr;
-    }
+        // copy of a node list built up while parsing
+        template<typename T>
+        llvm::ArrayRef<T> Copy(const std::vector<T> &items)
+        {
+            static_assert(std::is_trivially_destructible_v<T>,
+                          "arena nodes are never destroyed");
+            T *data = _allocator.Allocate<T>(items.size());
+            std::uninitialized_copy(items.begin(), items.end(), data);
+            return {data, items.size()};
+        }
+
+        [[nodiscard]] size_t BytesAllocated() const
+        { return _allocator.getBytesAllocated(); }
+
+    private:
+        llvm::BumpPtrAllocator _allocator;
+    };
 
+    // Nodes print themselves as source-like text straight into the stream,
+    // so dumping a function is linear in its size.
     struct Expression
     {
-        virtual std::string ToStr()
-        { return ""; }
+        virtual void Print(llvm::raw_ostream &os) const
+        {}
 
-        virtual llvm::Value *codegen()
+        virtual llvm::Value *codegen(CodegenSession &session)
         {
             std::cout << "expr codegen" << std::endl;
             return nullptr;
         }
 
-        virtual ~Expression() = default;
     };
 
-    auto *t = llvm::Constant::getNullValue(llvm::Type::getDoubleTy(TheContext));
-
+    // an expression followed by ';', the base of all other statements
     struct Statement
     {
-        Statement()
-        {
-            std::cout << "Statement" << std::endl;
-        }
+        Statement() = default;
 
-        Statement(std::shared_ptr<Statement> left,
-                  std::shared_ptr<Statement> right) :
-                _left(std::move(left)),
-                _right(std::move(right))
+        Statement(Expression *expr) : _expr(expr)
         {
         }
 
-        Statement(std::shared_ptr<Expression> expr,
-                  std::shared_ptr<Statement> right = nullptr) :
-                _expr(std::move(expr)),
-                _right(std::move(right))
+        virtual void Print(llvm::raw_ostream &os) const
         {
+            if (_expr != nullptr)
+            {
+                _expr->Print(os);
+                os << ";\n";
+            }
         }
 
-        void SetExpr(std::shared_ptr<Expression> expr)
+        virtual llvm::Value *codegen(CodegenSession &session)
         {
-            _expr = std::move(expr);
+            std::cout << "Statement codegen" << std::endl;
+            if (_expr == nullptr)
+            {
+                return nullptr;
+            }
+            return _expr->codegen(session);
         }
 
-        void SetLeft(std::shared_ptr<Statement> left)
-        {
-            _left = std::move(left);
-        }
-        void SetRight(std::shared_ptr<Statement> right)
+        Expression *_expr = nullptr;
+    };
+
+    // statements between braces, kept in one array so long blocks are
+    // walked in a loop instead of one recursive call per statement
+    struct Block : public Statement
+    {
+        Block(llvm::ArrayRef<Statement *> stmts) :
+                Statement(nullptr), _stmts(stmts)
         {
-            _right = std::move(right);
         }
 
-        virtual std::string ToStr()
+        void Print(llvm::raw_ostream &os) const override
         {
-            std::string leftStr, rightStr;
-            if (_expr != nullptr)
+            for (auto *stmt : _stmts)
             {
-                leftStr = _expr->ToStr() + ";";
+                stmt->Print(os);
+                os << "\n";
             }
-            else
-            {
-                leftStr = _left->ToStr();
-            }
-            if (_right != nullptr)
-            {
-                rightStr = _right->ToStr();
-            }
-            return leftStr + "\n" + rightStr;
         }
 
-        virtual ~Statement() = default;
-
-        virtual llvm::Value *codegen()
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            // TODO:多个语句怎么办
-            std::cout << "Statement codegen" << std::endl;
-            llvm::Value *v;
-            if (_expr != nullptr)
+            // TODO:连续两个return会返回第二个，严重问题
+            // the value of the block is the last one that is not NoValue()
+            auto scope = session.Variables().Scope();
+            llvm::Value *v = session.NoValue();
+            for (auto *stmt : _stmts)
             {
-                // return _expr->codegen();
-                v = _expr->codegen();
-            }
-            else
-            {
-                // return _left->codegen();
-                v = _left->codegen();
-            }
-            if(_right != nullptr)
-            {
-                // TODO:连续两个return会返回第二个，严重问题
-                auto *r = _right->codegen();
-                if (r != t)
+                auto *r = stmt->codegen(session);
+                if (r != session.NoValue())
                 {
-                    return r;
+                    v = r;
                 }
-                return v;
-            }
-            else
-            {
-                return v;
             }
+            return v;
         }
 
-        std::shared_ptr<Statement> _left, _right;
-        std::shared_ptr<Expression> _expr;
+        llvm::ArrayRef<Statement *> _stmts;
     };
 
     struct EmptyStatement : public Statement
     {
-        EmptyStatement()
+        void Print(llvm::raw_ostream &os) const override
         {
-            std::cout << "Empty Statement" << std::endl;
+            os << "Empty Statement";
         }
 
-        std::string ToStr() override
-        {
-            return "Empty Statement";
-        }
-
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
             // TODO:error
-            return t;
+            return session.NoValue();
         };
     };
 
     struct Type
     {
-        Type(const std::string &type)
-        { _type = type; }
+        Type(std::string_view type) : _type(type)
+        {}
+
+        void Print(llvm::raw_ostream &os) const
+        { os << llvm::StringRef(_type.data(), _type.size()); }
+
+        llvm::Type *codegen(CodegenSession &session) const
+        { return session.LowerType(_type); }
+
+        std::string_view _type;
+    };
+
+    struct Identifier : public Expression
+    {
+        Identifier(SymbolId id) : _id(id)
+        {}
 
-        std::string ToStr()
-        { return _type; }
+        std::string_view Name() const
+        { return TheSymbols.Name(_id); }
 
-        std::string _type;
+        void Print(llvm::raw_ostream &os) const override
+        { os << SymbolName(_id); }
+
+        llvm::Value *codegen(CodegenSession &session) override
+        {
+            llvm::AllocaInst *v = session.LookupVariable(_id);
+            // TODO:remove commet symbol
+            if (!v)
+            {
+                return LogErrorV("Unknown variable name" + std::string(Name()));
+            }
+            return session.Builder().CreateLoad(v->getAllocatedType(), v,
+                                                SymbolName(_id));
+        }
+
+        SymbolId _id;
     };
 
-// TODO: 去掉重复
     struct BinaryOp : public Expression
     {
-        BinaryOp(std::string op, std::shared_ptr<Expression> left,
-                 std::shared_ptr<Expression> right) :
-                _op(std::move(op)),
-                _left(std::move(left)), _right(std::move(right))
+        BinaryOp(Opcode op, Expression *left, Expression *right) :
+                _op(op), _left(left), _right(right)
         {
         }
 
-        std::string ToStr() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            return _left->ToStr() + " " + _op + " " + _right->ToStr();
+            auto spelling = OpcodeOperator(_op).spelling;
+            PrintOperand(os, _op, _left, false);
+            os << " " << llvm::StringRef(spelling.data(), spelling.size())
+               << " ";
+            PrintOperand(os, _op, _right, true);
         }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            llvm::Value *l = _left->codegen();
-            llvm::Value *r = _right->codegen();
+            llvm::Value *l = _left->codegen(session);
+            if (l != nullptr && (_op == OpOr || _op == OpAnd))
+            {
+                return session.EmitShortCircuit(
+                        _op, l, [&]
+                        { return _right->codegen(session); });
+            }
+            llvm::Value *r = _right->codegen(session);
             if (!l || !r)
             {
                 return nullptr;
             }
-            switch (_op[0])
-            {
-                case '+':
-                    return Builder.CreateFAdd(l, r, "addtmp");
-                case '-':
-                    return Builder.CreateFSub(l, r, "subtmp");
-                case '*':
-                    return Builder.CreateFMul(l, r, "multmp");
-                case '<':
-                    l = Builder.CreateFCmpULT(l, r, "cmptmp");
-                    return Builder.CreateUIToFP(
-                            l, llvm::Type::getDoubleTy(TheContext), "booltmp");
-                case '>':
-                    l = Builder.CreateFCmpULT(r, l, "cmptmp");
-                    return Builder.CreateUIToFP(
-                            l, llvm::Type::getDoubleTy(TheContext), "booltmp");
-                case '=':
+            if (_op == OpAssign)
+            {
+                // TODO:error
+                auto *target = dynamic_cast<Identifier *>(_left);
+                if (target == nullptr)
                 {
-                    // TODO:error
-                    // NamedValues[_left->ToStr()] = r;
-                    llvm::Value *var = NamedValues[_left->ToStr()];
-                    Builder.CreateStore(r, var);
-                    return r;
+                    return LogErrorV("invalid assignment target");
                 }
-                default:
-                    return LogErrorV("invalid binary operator" + _op);
+                return session.EmitStore(r,
+                                         session.LookupVariable(target->_id));
             }
+            return session.EmitBinary(_op, l, r);
         }
 
-        std::string _op;
+        Opcode _op;
+
+        Expression *_left, *_right;
 
-        std::shared_ptr<Expression> _left, _right;
+        // an operand of parent, in parentheses when it is a binary operation
+        // that would otherwise be read differently
+        static void PrintOperand(llvm::raw_ostream &os, Opcode parent,
+                                 const Expression *operand, bool right)
+        {
+            auto *binary = dynamic_cast<const BinaryOp *>(operand);
+            if (binary != nullptr && NeedsParens(parent, binary->_op, right))
+            {
+                os << "(";
+                operand->Print(os);
+                os << ")";
+                return;
+            }
+            operand->Print(os);
+        }
     };
 
     struct UnaryOp : public Expression
     {
-        UnaryOp(std::string op, std::shared_ptr<Expression> val) :
-                _op(std::move(op)), _val(std::move(val))
+        UnaryOp(Opcode op, Expression *val) : _op(op), _val(val)
         {
         }
 
-        std::string ToStr() override
-        { return _op + " " + _val->ToStr(); }
+        void Print(llvm::raw_ostream &os) const override
+        {
+            auto spelling = OpcodeOperator(_op).spelling;
+            os << llvm::StringRef(spelling.data(), spelling.size()) << " ";
+            BinaryOp::PrintOperand(os, _op, _val, true);
+        }
 
-        llvm::Value *codegen() override
-        { return nullptr; }
+        llvm::Value *codegen(CodegenSession &session) override
+        {
+            llvm::Value *v = _val->codegen(session);
+            if (v == nullptr)
+            {
+                return nullptr;
+            }
+            return session.EmitUnary(_op, v);
+        }
 
-        std::string _op;
+        Opcode _op;
 
-        std::shared_ptr<Expression> _val;
+        Expression *_val;
     };
 
-    struct Identifier : public Expression
+    // an int literal has no '.', its value is in _int
+    struct NumberLiteral : public Expression
     {
-        Identifier(std::string name) : _name(std::move(name))
+        NumberLiteral(float val) : _val(val)
         {}
 
-        std::string Name() const
-        { return _name; }
+        NumberLiteral(int32_t val) : _int(val), _integer(true)
+        {}
 
-        std::string ToStr() override
-        { return _name; }
+        [[nodiscard]] float Float() const
+        { return _integer ? static_cast<float>(_int) : _val; }
 
-        llvm::Value *codegen() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            llvm::Value *v = NamedValues[_name];
-            // TODO:remove commet symbol
-            if (!v)
+            if (_integer)
             {
-                std::string s = "Unknown variable name" + _name;
-                return LogErrorV(s.c_str());
+                os << _int;
+                return;
             }
-            return Builder.CreateLoad(v, _name);
+            // %g is what std::ostream prints a float as
+            os << llvm::format("%g", _val);
         }
 
-        std::string _name;
-    };
-
-// TODO:refactor
-    struct NumberLiteral : public Expression
-    {
-        NumberLiteral(std::string val) : _val(std::move(val))
-        {}
-
-        std::string ToStr() override
-        { return _val; }
-
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            return llvm::ConstantFP::get(TheContext, llvm::APFloat(std::stof(_val)));
+            if (_integer)
+            {
+                return llvm::ConstantInt::get(
+                        llvm::Type::getInt32Ty(session.Context()), _int, true);
+            }
+            return llvm::ConstantFP::get(session.Context(),
+                                         llvm::APFloat(_val));
         }
 
-        std::string _val;
+        float _val = 0;
+        int32_t _int = 0;
+        bool _integer = false;
     };
 
     struct StringLiteral : public Expression
     {
-        StringLiteral(const std::string &val) : _val(val)
+        StringLiteral(std::string_view val) : _val(val)
         {}
 
-        std::string ToStr() override
-        { return _val; }
+        void Print(llvm::raw_ostream &os) const override
+        { os << llvm::StringRef(_val.data(), _val.size()); }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         { return nullptr; }
 
-        std::string _val;
+        std::string_view _val;
     };
 
     struct BoolLiteral : public Expression
     {
-        BoolLiteral(const std::string &val) : _val(val)
+        BoolLiteral(std::string_view val) : _val(val)
         {}
 
-        std::string ToStr() override
-        { return _val; }
+        void Print(llvm::raw_ostream &os) const override
+        { os << llvm::StringRef(_val.data(), _val.size()); }
 
-        llvm::Value *codegen() override
-        { return nullptr; }
+        llvm::Value *codegen(CodegenSession &session) override
+        {
+            return llvm::ConstantInt::getBool(session.Context(),
+                                              _val == "true");
+        }
 
-        std::string _val;
+        std::string_view _val;
     };
 
     struct Args
     {
         Args() = default;
 
-        Args(std::vector<std::shared_ptr<Expression>> exprs) :
-                _exprs(std::move(exprs))
+        Args(llvm::ArrayRef<Expression *> exprs) :
+                _exprs(exprs)
         {
         }
 
         [[nodiscard]] size_t Size() const
         { return _exprs.size(); }
 
-        std::string ToStr()
+        void Print(llvm::raw_ostream &os) const
         {
-            std::string str;
-            for (auto &&expr : _exprs)
-            {
-                str += (expr->ToStr() + ",");
-            }
-            if (!str.empty())
+            for (size_t i = 0; i < _exprs.size(); ++i)
             {
-                str.pop_back();
+                if (i != 0)
+                {
+                    os << ",";
+                }
+                _exprs[i]->Print(os);
             }
-            return str;
         }
 
-        std::vector<std::shared_ptr<Expression>> _exprs;
+        llvm::ArrayRef<Expression *> _exprs;
     };
 
     struct Param
     {
         Param() = default;
 
-        Param(std::vector<std::pair<Type, Identifier>> params) :
-                _params(std::move(params))
+        Param(llvm::ArrayRef<std::pair<Type, Identifier>> params) :
+                _params(params)
         {
         }
 
-        std::vector<std::pair<Type, Identifier>> _params;
+        llvm::ArrayRef<std::pair<Type, Identifier>> _params;
 
-        std::string ToStr()
+        void Print(llvm::raw_ostream &os) const
         {
-            std::string str;
-            for (auto &&param : _params)
-            {
-                str += param.first.ToStr() + " " + param.second.ToStr() + ",";
-            }
-            if (!str.empty())
+            for (size_t i = 0; i < _params.size(); ++i)
             {
-                str.pop_back();
+                if (i != 0)
+                {
+                    os << ",";
+                }
+                _params[i].first.Print(os);
+                os << " ";
+                _params[i].second.Print(os);
             }
-            return str;
         }
 
         // TODO:重构，改为function proto
-        llvm::Function* codegen(const std::string& functionName)
+        llvm::Function* codegen(CodegenSession &session, SymbolId functionName,
+                                const Type &returnType)
         {
-            std::vector<llvm::Type *> doubles(_params.size(),
-                                              llvm::Type::getFloatTy(TheContext));
+            std::vector<llvm::Type *> types;
+            for (auto &param : _params)
+            {
+                types.push_back(param.first.codegen(session));
+            }
             llvm::FunctionType *ft = llvm::FunctionType::get(
-                    llvm::Type::getFloatTy(TheContext), doubles, false);
+                    returnType.codegen(session), types, false);
             llvm::Function *f = llvm::Function::Create(
-                    ft, llvm::Function::ExternalLinkage, functionName, TheModule.get());
+                    ft, llvm::Function::ExternalLinkage, SymbolName(functionName),
+                    &session.Module());
             if (f == nullptr)
             {
                 Boom();
@@ -402,7 +448,7 @@ namespace In
             for (auto &arg : f->args())
             {
                 std::cout << "param name:" << _params[index].second.Name() << std::endl;
-                arg.setName(_params[index++].second.Name());
+                arg.setName(SymbolName(_params[index++].second._id));
             }
             return f;
         }
@@ -415,14 +461,18 @@ namespace In
         {
         }
 
-        std::string ToStr() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            return _identifier.ToStr() + "(" + _args.ToStr() + ")";
+            _identifier.Print(os);
+            os << "(";
+            _args.Print(os);
+            os << ")";
         }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            llvm::Function *calleeF = TheModule->getFunction(_identifier._name);
+            llvm::Function *calleeF =
+                    session.Functions().lookup(_identifier._id);
             if (!calleeF)
             {
                 return LogErrorV("Unknown function referenced");
@@ -432,15 +482,15 @@ namespace In
                 return LogErrorV("Incorrect arguments passed");
             }
             std::vector<llvm::Value *> argsV;
-            for (int i = 0; i < _args.Size(); ++i)
+            for (size_t i = 0; i < _args.Size(); ++i)
             {
-                argsV.push_back(_args._exprs[i]->codegen());
+                argsV.push_back(_args._exprs[i]->codegen(session));
                 if (!argsV.back())
                 {
                     return nullptr;
                 }
             }
-            return Builder.CreateCall(calleeF, argsV, "calltmp");
+            return session.EmitCall(calleeF, argsV);
         }
 
         Identifier _identifier;
@@ -450,201 +500,239 @@ namespace In
 
     struct Assign : public Expression
     {
-        Assign(Identifier name, std::shared_ptr<Expression> val):
-            _name(std::move(name)), _val(std::move(val))
+        Assign(Type type, Identifier name, Expression *val):
+            _type(std::move(type)), _name(std::move(name)), _val(val)
         {
 
         }
 
-        std::string ToStr() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            return _name.ToStr() + " = " + _val->ToStr();
+            _name.Print(os);
+            os << " = ";
+            _val->Print(os);
         }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
             // TODO:assign和binary operator里的=，注意改掉
             // assign检查变量是否存在，如果存在则报重复的错误
             // TODO:maybe problem
-            auto *function = Builder.GetInsertBlock()->getParent();
-            auto *alloca = CreateEntryBlockAlloca(function, _name.Name());
-            auto *val = _val->codegen();
-            // NamedValues[_name.Name()] = _val->codegen();
-            Builder.CreateStore(val, alloca);
-            NamedValues[_name.Name()] = alloca;
+            auto *function = session.Builder().GetInsertBlock()->getParent();
+            auto *alloca = session.CreateEntryBlockAlloca(
+                    function, _name._id, _type.codegen(session));
+            auto *val = _val->codegen(session);
+            if (val == nullptr)
+            {
+                return nullptr;
+            }
+            val = session.EmitStore(val, alloca);
+            session.Variables().Define(_name._id, {alloca});
             return val;
         }
+        Type _type;
         Identifier _name;
-        std::shared_ptr<Expression> _val;
+        Expression *_val;
     };
 
     struct SetNewVal : public Expression
     {
-        SetNewVal(Identifier name, std::shared_ptr<Expression> val):
-                _name(std::move(name)), _val(std::move(val))
+        SetNewVal(Identifier name, Expression *val):
+                _name(std::move(name)), _val(val)
         {
 
         }
 
-        std::string ToStr() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            return _name.ToStr() + " = " + _val->ToStr();
+            _name.Print(os);
+            os << " = ";
+            _val->Print(os);
         }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            auto *val = _val->codegen();
-            auto *alloca = NamedValues[_name.Name()];
-            Builder.CreateStore(val, alloca);
-            return val;
+            auto *val = _val->codegen(session);
+            if (val == nullptr)
+            {
+                return nullptr;
+            }
+            return session.EmitStore(val, session.LookupVariable(_name._id));
         }
         Identifier _name;
-        std::shared_ptr<Expression> _val;
+        Expression *_val;
     };
 
     struct Return : public Statement
     {
-        Return(std::shared_ptr<Expression> expr) : _expr(std::move(expr))
+        Return(Expression *expr) : _expr(expr)
         {}
 
-        std::shared_ptr<Expression> _expr;
+        Expression *_expr;
 
-        std::string ToStr() override
-        { return "return " + _expr->ToStr() + ";"; }
+        void Print(llvm::raw_ostream &os) const override
+        {
+            os << "return ";
+            _expr->Print(os);
+            os << ";";
+        }
 
-        llvm::Value *codegen() override
-        { return _expr->codegen(); }
+        llvm::Value *codegen(CodegenSession &session) override
+        { return _expr->codegen(session); }
     };
 
     struct If : public Statement
     {
-        If(std::shared_ptr<Expression> cond, std::shared_ptr<Statement> conseq,
-           std::shared_ptr<Statement> alt) :
-                _cond(std::move(cond)),
-                _conseq(std::move(conseq)), _alt(std::move(alt))
+        If(Expression *cond, Statement *conseq,
+           Statement *alt) :
+                _cond(cond),
+                _conseq(conseq), _alt(alt)
         {
         }
 
-        std::shared_ptr<Expression> _cond;
-        std::shared_ptr<Statement> _conseq, _alt;
+        Expression *_cond;
+        Statement *_conseq, *_alt;
 
-        std::string ToStr() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            // TODO:alt
-            std::string altStr;
+            os << "if(";
+            _cond->Print(os);
+            os << ")\n{\n";
+            _conseq->Print(os);
+            os << "\n}\n";
             if (_alt != nullptr)
             {
-                altStr = "else\n{\n" + _alt->ToStr() + "\n}\n";
+                os << "else\n{\n";
+                _alt->Print(os);
+                os << "\n}\n";
             }
-            return "if(" + _cond->ToStr() + ")\n{\n" + _conseq->ToStr() + "\n}\n"
-                   + altStr;
         }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            llvm::Value *cond = _cond->codegen();
+            auto &builder = session.Builder();
+            llvm::Value *cond = _cond->codegen(session);
+            if(cond == nullptr)
+            {
+                return nullptr;
+            }
+            cond = session.Convert(cond, builder.getInt1Ty(), "ifcond");
             if(cond == nullptr)
             {
                 return nullptr;
             }
-            // Convert condition to a bool by comparing non-equal to 0.0.
-            cond = Builder.CreateFCmpONE(cond, llvm::ConstantFP::get(TheContext,
-                    llvm::APFloat(0.0)), "ifcond");
             // TODO:感觉有问题
-            llvm::Function *function = Builder.GetInsertBlock()->getParent();
+            llvm::Function *function = builder.GetInsertBlock()->getParent();
             // 参数带了function，自动将块插入到function的末尾
-            llvm::BasicBlock *thenBlock = llvm::BasicBlock::Create(TheContext,
+            llvm::BasicBlock *thenBlock = llvm::BasicBlock::Create(session.Context(),
                     "then", function);
-            llvm::BasicBlock *elseBlock = llvm::BasicBlock::Create(TheContext, "else");
             // 所有基本块通过控制流终止 branch / return
-            llvm::BasicBlock *mergeBlock = llvm::BasicBlock::Create(TheContext, "ifcont");
-            Builder.CreateCondBr(cond, thenBlock, elseBlock);
+            llvm::BasicBlock *mergeBlock = llvm::BasicBlock::Create(session.Context(), "ifcont");
+            // without an else a false condition goes straight to the merge
+            llvm::BasicBlock *elseBlock = _alt != nullptr
+                    ? llvm::BasicBlock::Create(session.Context(), "else")
+                    : mergeBlock;
+            builder.CreateCondBr(cond, thenBlock, elseBlock);
 
             // then value
             // 从ThenBlock的位置开始插入IR
-            Builder.SetInsertPoint(thenBlock);
-            llvm::Value *thenVal = _conseq->codegen();
+            builder.SetInsertPoint(thenBlock);
+            llvm::Value *thenVal = _conseq->codegen(session);
             if(thenVal == nullptr)
             {
                 return thenVal;
             }
             // 创建一个 通过branch到达if后的内容 的IR
             // br label %ifconf
-            Builder.CreateBr(mergeBlock);
+            builder.CreateBr(mergeBlock);
             // Codegen of 'Then' can change the current block, update ThenBB for the PHI.
-            thenBlock = Builder.GetInsertBlock();
+            thenBlock = builder.GetInsertBlock();
+
+            if(_alt == nullptr)
+            {
+                function->getBasicBlockList().push_back(mergeBlock);
+                builder.SetInsertPoint(mergeBlock);
+                return session.NoValue();
+            }
 
             // else block
             // 在后面添加一个块
             function->getBasicBlockList().push_back(elseBlock);
-            Builder.SetInsertPoint(elseBlock);
+            builder.SetInsertPoint(elseBlock);
 
-            llvm::Value *elseVal = _alt->codegen();
+            llvm::Value *elseVal = _alt->codegen(session);
             if(elseVal == nullptr)
             {
                 return nullptr;
             }
-            Builder.CreateBr(mergeBlock);
+            builder.CreateBr(mergeBlock);
             // codegen of 'Else' can change the current block, update ElseBB for the PHI.
-            elseBlock = Builder.GetInsertBlock();
+            elseBlock = builder.GetInsertBlock();
 
             // merge block
             function->getBasicBlockList().push_back(mergeBlock);
-            Builder.SetInsertPoint(mergeBlock);
-            llvm::PHINode *pn = Builder.CreatePHI(llvm::Type::getFloatTy(TheContext),
-                    2, "iftmp");
-            pn->addIncoming(thenVal, thenBlock);
-            pn->addIncoming(elseVal, elseBlock);
-            return pn;
+            builder.SetInsertPoint(mergeBlock);
+            return session.EmitPhi(thenVal, thenBlock, elseVal, elseBlock);
         }
     };
 
     struct For : public Statement
     {
-        For(std::shared_ptr<Expression> init,
-                std::shared_ptr<Expression> condition,
-                std::shared_ptr<Expression> step,
-                std::shared_ptr<Statement> body):
-                _init(std::move(init)), _condition(std::move(condition)),
-                _body(std::move(body)), _step(std::move(step))
+        For(Expression *init,
+                Expression *condition,
+                Expression *step,
+                Statement *body):
+                _init(init), _condition(condition),
+                _step(step), _body(body)
         {
 
         }
 
-        std::string ToStr() override
+        void Print(llvm::raw_ostream &os) const override
         {
-            return "for(" + _init->ToStr() + ";" + _condition->ToStr() +
-                ";" + _step->ToStr() + ")\n{\n" + _body->ToStr() + "\n}\n";
+            os << "for(";
+            _init->Print(os);
+            os << ";";
+            _condition->Print(os);
+            os << ";";
+            _step->Print(os);
+            os << ")\n{\n";
+            _body->Print(os);
+            os << "\n}\n";
         }
 
-        llvm::Value *codegen() override
+        llvm::Value *codegen(CodegenSession &session) override
         {
-            auto *theFunction = Builder.GetInsertBlock()->getParent();
-            std::string varName = std::dynamic_pointer_cast<Assign>(_init)->_name.ToStr();
-            auto *alloca = CreateEntryBlockAlloca(theFunction, varName);
-            auto *init = _init->codegen();
+            auto &builder = session.Builder();
+            auto *theFunction = builder.GetInsertBlock()->getParent();
+            auto *assign = dynamic_cast<Assign *>(_init);
+            SymbolId varName = assign->_name._id;
+            auto *alloca = session.CreateEntryBlockAlloca(
+                    theFunction, varName, assign->_type.codegen(session));
+            // the loop variable is only in scope of the loop
+            auto scope = session.Variables().Scope();
+            auto *init = _init->codegen(session);
             if(init == nullptr)
             {
                 return nullptr;
             }
             // TODO:error
-            Builder.CreateStore(init, alloca);
+            session.EmitStore(init, alloca);
 
             // auto *preHeaderBlock = Builder.GetInsertBlock();
-            auto *loopBlock = llvm::BasicBlock::Create(TheContext, "loop", theFunction);
+            auto *loopBlock = llvm::BasicBlock::Create(session.Context(),
+                                                       "loop", theFunction);
 
-            Builder.CreateBr(loopBlock);
+            builder.CreateBr(loopBlock);
 
-            Builder.SetInsertPoint(loopBlock);
+            builder.SetInsertPoint(loopBlock);
 //            auto *variable = Builder.CreatePHI(llvm::Type::getFloatTy(TheContext),
 //                    2, varName);
 //            variable->addIncoming(init, preHeaderBlock);
 
-            auto *oldVal = NamedValues[varName];
-            // NamedValues[varName] = variable;
-            NamedValues[varName] = alloca;
+            session.Variables().Define(varName, {alloca});
 
-            if(_body->codegen() == nullptr)
+            if(_body->codegen(session) == nullptr)
             {
                 return nullptr;
             }
@@ -652,7 +740,7 @@ namespace In
             llvm::Value *stepVal = nullptr;
             if(_step)
             {
-                stepVal = _step->codegen();
+                stepVal = _step->codegen(session);
                 if(stepVal == nullptr)
                 {
                     return nullptr;
@@ -660,44 +748,40 @@ namespace In
             }
             else
             {
-                stepVal = llvm::ConstantFP::get(TheContext, llvm::APFloat(1.0));
+                stepVal = builder.getInt32(1);
             }
 
             // auto *nextVar = Builder.CreateFAdd(variable, stepVal, "nextvar");
 
-            auto *endCond = _condition->codegen();
+            auto *endCond = _condition->codegen(session);
             if(endCond == nullptr)
             {
                 return nullptr;
             }
-            auto *curVar = Builder.CreateLoad(alloca, varName);
+            auto *curVar = builder.CreateLoad(alloca->getAllocatedType(), alloca,
+                                              SymbolName(varName));
             // TODO: step用法不一样
-            auto *nextVar = Builder.CreateFAdd(curVar, stepVal, "nextvar");
-            Builder.CreateStore(nextVar, alloca);
-
-            endCond = Builder.CreateFCmpONE(endCond,
-                    llvm::ConstantFP::get(TheContext, llvm::APFloat(0.0)), "loop cond");
+            auto *nextVar = session.EmitBinary(OpAdd, curVar, stepVal);
+            endCond = session.Convert(endCond, builder.getInt1Ty(),
+                                      "loop cond");
+            if(nextVar == nullptr || endCond == nullptr)
+            {
+                return nullptr;
+            }
+            session.EmitStore(nextVar, alloca);
 
             // auto *loopEndBlock = Builder.GetInsertBlock();
             auto *afterBlock = llvm::BasicBlock::Create(
-                    TheContext, "afterLoop", theFunction);
-            Builder.CreateCondBr(endCond, loopBlock, afterBlock);
-            Builder.SetInsertPoint(afterBlock);
+                    session.Context(), "afterLoop", theFunction);
+            builder.CreateCondBr(endCond, loopBlock, afterBlock);
+            builder.SetInsertPoint(afterBlock);
 
             // variable->addIncoming(nextVar, loopEndBlock);
-            if(oldVal)
-            {
-                NamedValues[varName] = oldVal;
-            }
-            else
-            {
-                NamedValues.erase(varName);
-            }
-            return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(TheContext));
+            return session.NoValue();
         }
 
-        std::shared_ptr<Expression> _init, _condition, _step;
-        std::shared_ptr<Statement> _body;
+        Expression *_init, *_condition, *_step;
+        Statement *_body;
     };
 
     struct While : public Statement
@@ -708,25 +792,29 @@ namespace In
     {
         // function name and ret val
         Function(Type type, Identifier name, Param params,
-                 std::shared_ptr<Statement> body) :
+                 Statement *body) :
                 _type(std::move(type)),
                 _name(std::move(name)), _params(std::move(params)),
-                _body(std::move(body))
+                _body(body)
         {
         }
 
-        std::string ToStr()
+        void Print(llvm::raw_ostream &os) const
         {
-            std::string bodyStr;
+            _type.Print(os);
+            os << " ";
+            _name.Print(os);
+            os << " (";
+            _params.Print(os);
+            os << ")\n{\n";
             if (_body != nullptr)
             {
-                bodyStr = _body->ToStr();
+                _body->Print(os);
             }
-            return _type.ToStr() + " " + _name.ToStr() + " (" + _params.ToStr()
-                   + ")" + "\n{\n" + bodyStr + "}\n";
+            os << "}\n";
         }
 
-        llvm::Function *codegen()
+        llvm::Function *codegen(CodegenSession &session)
         {
             // TODO:function prototype
             // TODO:type
@@ -735,16 +823,12 @@ namespace In
             // params type
             // changed
 
-            auto *f = _params.codegen(_name.ToStr());
-            // function->codegen
-            llvm::Function *theFunction = TheModule->getFunction(_name.Name());
-            if (!theFunction)
-            {
-                theFunction = f;
-            }
+            auto &builder = session.Builder();
+            llvm::Function *theFunction = session.Functions().lookup(_name._id);
             if (!theFunction)
             {
-                return nullptr;
+                theFunction = _params.codegen(session, _name._id, _type);
+                session.Functions()[_name._id] = theFunction;
             }
 
             if (!theFunction->empty())
@@ -753,26 +837,31 @@ namespace In
             }
             // 创建新的BasicBlock
             llvm::BasicBlock *bb =
-                    llvm::BasicBlock::Create(TheContext, "entry", theFunction);
+                    llvm::BasicBlock::Create(session.Context(), "entry",
+                                             theFunction);
             // 之后的指令的插入点设置为BasicBlock后面
-            Builder.SetInsertPoint(bb);
+            builder.SetInsertPoint(bb);
             // TODO:可能有问题
-            NamedValues.clear();
+            session.Variables().Clear();
+            auto scope = session.Variables().Scope();
+            unsigned index = 0;
             for (auto &arg : theFunction->args())
             {
-                auto *alloca = CreateEntryBlockAlloca(theFunction, arg.getName());
-                Builder.CreateStore(&arg, alloca);
+                auto name = _params._params[index++].second._id;
+                auto *alloca = session.CreateEntryBlockAlloca(
+                        theFunction, name, arg.getType());
+                builder.CreateStore(&arg, alloca);
                 // NamedValues[arg.getName()] = &arg;
-                NamedValues[arg.getName()] = alloca;
+                session.Variables().Define(name, {alloca});
             }
-            if (llvm::Value *retVal = _body->codegen())
+            llvm::Value *retVal = _body->codegen(session);
+            if (retVal != nullptr && session.EmitReturn(retVal, theFunction))
             {
-                Builder.CreateRet(retVal);
-                llvm::verifyFunction(*theFunction);
-                
+                session.FinishFunction(*theFunction);
                 return theFunction;
             }
             // Error reading body, remove function.
+            session.Functions().erase(_name._id);
             theFunction->eraseFromParent();
             return nullptr;
         }
@@ -780,7 +869,7 @@ namespace In
         Type _type;
         Identifier _name;
         Param _params;
-        std::shared_ptr<Statement> _body;
+        Statement *_body;
     };
 }
 #endif // INTERPRETER_AST_HPP
@@ -0,0 +1,96 @@
+//
+// On-disk cache of parsed sources.
+//
+
+#ifndef INTERPRETER_ASTCACHE_HPP
+#define INTERPRETER_ASTCACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "FlatAST.hpp"
+
+namespace In
+{
+    // Flat ASTs of sources that parsed without errors, one file per source
+    // named after the hash of its text. Unchanged sources are mapped back
+    // instead of lexed and parsed again.
+    class AstCache
+    {
+    public:
+        explicit AstCache(std::string directory) :
+                _directory(std::move(directory))
+        {
+        }
+
+        static uint64_t Key(std::string_view source)
+        { return llvm::xxHash64({source.data(), source.size()}); }
+
+        // false on a miss, or a file that is stale or damaged
+        bool Load(uint64_t key, FlatAst &ast) const
+        {
+            auto buffer = llvm::MemoryBuffer::getFile(Path(key));
+            if (!buffer)
+            {
+                return false;
+            }
+            return ast.Map(std::move(*buffer), key);
+        }
+
+        // Written to a temporary file renamed into place, so a compile that
+        // runs at the same time never maps a half written one. A cache that
+        // can't be written only costs the next compile a parse.
+        void Store(uint64_t key, const FlatAst &ast) const
+        {
+            if (auto ec = llvm::sys::fs::create_directories(_directory))
+            {
+                Warn(ec.message());
+                return;
+            }
+            auto file = llvm::sys::fs::TempFile::create(
+                    _directory + "/ast-%%%%%%%%.tmp");
+            if (!file)
+            {
+                Warn(llvm::toString(file.takeError()));
+                return;
+            }
+            {
+                llvm::raw_fd_ostream os(file->FD, false);
+                ast.Save(os, key);
+            }
+            if (auto error = file->keep(Path(key)))
+            {
+                Warn(llvm::toString(std::move(error)));
+                llvm::consumeError(file->discard());
+            }
+        }
+
+    private:
+        std::string Path(uint64_t key) const
+        {
+            std::string path;
+            llvm::raw_string_ostream os(path);
+            os << _directory << "/" << llvm::format_hex_no_prefix(key, 16)
+               << ".ast";
+            return os.str();
+        }
+
+        void Warn(const std::string &message) const
+        {
+            llvm::errs() << "warning: can't write AST cache in " << _directory
+                         << ": " << message << "\n";
+        }
+
+        std::string _directory;
+    };
+}
+
+#endif //INTERPRETER_ASTCACHE_HPP
@@ -0,0 +1,212 @@
+//
+// Character classification and bulk scanning used by the lexer.
+//
+
+#ifndef INTERPRETER_CHARCLASS_HPP
+#define INTERPRETER_CHARCLASS_HPP
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+namespace In
+{
+    // one bit per class, a byte can belong to several of them
+    enum CharClass : uint8_t
+    {
+        BlankClass = 1u << 0u,
+        LetterClass = 1u << 1u,
+        DigitClass = 1u << 2u,
+        OperatorClass = 1u << 3u,
+        SymbolClass = 1u << 4u,
+        // letter, digit or '_'
+        IdentifierClass = 1u << 5u
+    };
+
+    constexpr std::array<uint8_t, 256> MakeCharClassTable()
+    {
+        std::array<uint8_t, 256> table{};
+        auto add = [&](std::string_view chars, uint8_t charClass)
+        {
+            for (auto c : chars)
+            {
+                table[static_cast<unsigned char>(c)] |= charClass;
+            }
+        };
+        add("\r\n\t ", BlankClass);
+        // TODO: ++ --
+        add("+-*/%=!|&><~", OperatorClass);
+        add("{}();:,", SymbolClass);
+        for (size_t c = 0; c < table.size(); ++c)
+        {
+            if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+            {
+                table[c] |= LetterClass | IdentifierClass;
+            }
+            else if (c >= '0' && c <= '9')
+            {
+                table[c] |= DigitClass | IdentifierClass;
+            }
+        }
+        add("_", IdentifierClass);
+        return table;
+    }
+
+    inline constexpr std::array<uint8_t, 256> CharClassTable =
+            MakeCharClassTable();
+
+    inline bool HasCharClass(char c, uint8_t charClass)
+    {
+        return (CharClassTable[static_cast<unsigned char>(c)] & charClass) != 0;
+    }
+
+    // The Simd*Mask functions return one bit per byte of the block starting at
+    // p, set when the byte belongs to the class. Loads are unaligned, callers
+    // guarantee SimdWidth readable bytes.
+#if defined(__AVX2__)
+    constexpr size_t SimdWidth = 32;
+
+    inline uint32_t SimdCharMask(const char *p, char c)
+    {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))));
+    }
+
+    inline uint32_t SimdBlankMask(const char *p)
+    {
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        auto blank = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(blank));
+    }
+
+    inline uint32_t SimdIdentifierMask(const char *p)
+    {
+        // there is no unsigned byte compare, so shift each range down to
+        // start at -128 and use a signed less-than against -128 + length
+        auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+        auto lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        auto letterBias = _mm256_set1_epi8(static_cast<char>(-128 - 'a'));
+        auto digitBias = _mm256_set1_epi8(static_cast<char>(-128 - '0'));
+        auto letter = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26),
+                                        _mm256_add_epi8(lower, letterBias));
+        auto digit = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 10),
+                                       _mm256_add_epi8(v, digitBias));
+        auto underscore = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+        return static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_or_si256(letter, digit), underscore)));
+    }
+#elif defined(__SSE2__)
+    constexpr size_t SimdWidth = 16;
+
+    inline uint32_t SimdCharMask(const char *p, char c)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        return static_cast<uint32_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))));
+    }
+
+    inline uint32_t SimdBlankMask(const char *p)
+    {
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        auto blank = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        return static_cast<uint32_t>(_mm_movemask_epi8(blank));
+    }
+
+    inline uint32_t SimdIdentifierMask(const char *p)
+    {
+        // there is no unsigned byte compare, so shift each range down to
+        // start at -128 and use a signed less-than against -128 + length
+        auto v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        auto lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        auto letterBias = _mm_set1_epi8(static_cast<char>(-128 - 'a'));
+        auto digitBias = _mm_set1_epi8(static_cast<char>(-128 - '0'));
+        auto letter = _mm_cmplt_epi8(_mm_add_epi8(lower, letterBias),
+                                     _mm_set1_epi8(-128 + 26));
+        auto digit = _mm_cmplt_epi8(_mm_add_epi8(v, digitBias),
+                                    _mm_set1_epi8(-128 + 10));
+        auto underscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+        return static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_or_si128(_mm_or_si128(letter, digit), underscore)));
+    }
+#else
+    // scalar only, ScanWhile never calls the block masks
+    constexpr size_t SimdWidth = 0;
+
+    inline uint32_t SimdCharMask(const char *, char)
+    { return 0; }
+
+    inline uint32_t SimdBlankMask(const char *)
+    { return 0; }
+
+    inline uint32_t SimdIdentifierMask(const char *)
+    { return 0; }
+#endif
+
+    // Advance from i while the byte at i matches, first whole blocks through
+    // the vector mask, then the tail byte by byte through the scalar test.
+    // Returns the index of the first byte that does not match, or str.size().
+    template<typename BlockMask, typename Match>
+    size_t ScanWhile(std::string_view str, size_t i, BlockMask &&blockMask,
+                     Match &&match)
+    {
+        if constexpr (SimdWidth != 0)
+        {
+            constexpr uint32_t allMatch = SimdWidth == 32 ? 0xFFFFFFFFu
+                                                          : 0xFFFFu;
+            while (i + SimdWidth <= str.size())
+            {
+                uint32_t stop = ~blockMask(str.data() + i) & allMatch;
+                if (stop != 0)
+                {
+                    return i + std::countr_zero(stop);
+                }
+                i += SimdWidth;
+            }
+        }
+        while (i < str.size() && match(str[i]))
+        {
+            ++i;
+        }
+        return i;
+    }
+
+    size_t SkipBlank(std::string_view str, size_t i)
+    {
+        return ScanWhile(
+                str, i, [](const char *p) { return SimdBlankMask(p); },
+                [](char c) { return HasCharClass(c, BlankClass); });
+    }
+
+    size_t SkipIdentifierBody(std::string_view str, size_t i)
+    {
+        return ScanWhile(
+                str, i, [](const char *p) { return SimdIdentifierMask(p); },
+                [](char c) { return HasCharClass(c, IdentifierClass); });
+    }
+
+    // index of the first c at or after i, str.size() when there is none
+    size_t FindChar(std::string_view str, char c, size_t i)
+    {
+        return ScanWhile(
+                str, i, [c](const char *p) { return ~SimdCharMask(p, c); },
+                [c](char x) { return x != c; });
+    }
+}
+
+#endif //INTERPRETER_CHARCLASS_HPP
@@ -0,0 +1,512 @@
+//
+// State of one compilation's code generation.
+//
+
+#ifndef INTERPRETER_CODEGEN_HPP
+#define INTERPRETER_CODEGEN_HPP
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Type.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Utils.h"
+
+#include "Operator.hpp"
+#include "Scope.hpp"
+#include "Symbol.hpp"
+
+namespace In
+{
+    llvm::StringRef SymbolName(SymbolId id)
+    {
+        auto name = TheSymbols.Name(id);
+        return {name.data(), name.size()};
+    }
+
+    llvm::Value *LogErrorV(const std::string& str)
+    {
+        std::cout << str << std::endl;
+        return nullptr;
+    }
+
+    struct Variable
+    {
+        llvm::AllocaInst *alloca;
+    };
+
+    // Everything code is generated into and with: an LLVMContext of its own,
+    // the builder, the module, the functions generated so far and the locals
+    // in scope. Sessions share nothing but the symbol pool, which is safe to
+    // use from any thread, so independent compilations can run at the same
+    // time on different threads, one session each.
+    class CodegenSession
+    {
+    public:
+        explicit CodegenSession(llvm::StringRef moduleName = "my cool jit") :
+                _context(std::make_unique<llvm::LLVMContext>()),
+                _builder(*_context),
+                _module(std::make_unique<llvm::Module>(moduleName, *_context)),
+                _noValue(llvm::Constant::getNullValue(
+                        llvm::Type::getDoubleTy(*_context)))
+        {
+        }
+
+        CodegenSession(const CodegenSession &) = delete;
+
+        CodegenSession &operator=(const CodegenSession &) = delete;
+
+        llvm::LLVMContext &Context()
+        { return *_context; }
+
+        llvm::IRBuilder<> &Builder()
+        { return _builder; }
+
+        llvm::Module &Module()
+        { return *_module; }
+
+        // Hand the module over together with the context it lives in, to a
+        // JIT. Nothing can be generated into the session after this.
+        llvm::orc::ThreadSafeModule TakeModule()
+        {
+            _cleanup.reset();
+            _functions.clear();
+            return llvm::orc::ThreadSafeModule(std::move(_module),
+                                               std::move(_context));
+        }
+
+        // functions by symbol
+        llvm::DenseMap<SymbolId, llvm::Function *> &Functions()
+        { return _functions; }
+
+        // locals in scope of the function being generated
+        ScopedSymbolTable<Variable> &Variables()
+        { return _variables; }
+
+        // what a statement without a value gives, a block skips it
+        llvm::Value *NoValue() const
+        { return _noValue; }
+
+        // Clean up every function as it is finished: locals promoted from
+        // allocas to registers, then combined, redundancies removed and the
+        // CFG simplified. It only looks at the one function, so it is safe
+        // for bodies that are regenerated later.
+        void EnableCleanup()
+        {
+            _cleanup = std::make_unique<llvm::legacy::FunctionPassManager>(
+                    _module.get());
+            _cleanup->add(llvm::createPromoteMemoryToRegisterPass());
+            _cleanup->add(llvm::createInstructionCombiningPass());
+            _cleanup->add(llvm::createGVNPass());
+            _cleanup->add(llvm::createCFGSimplificationPass());
+            _cleanup->doInitialization();
+        }
+
+        // called once a function's body is complete
+        void FinishFunction(llvm::Function &function)
+        {
+            // the passes assume valid IR, a broken function is left as is
+            if (!llvm::verifyFunction(function) && _cleanup)
+            {
+                _cleanup->run(function);
+            }
+        }
+
+        // the alloca of the innermost local named name, null when there is
+        // none
+        llvm::AllocaInst *LookupVariable(SymbolId name)
+        {
+            auto *variable = _variables.Lookup(name);
+            return variable != nullptr ? variable->alloca : nullptr;
+        }
+
+        llvm::AllocaInst *CreateEntryBlockAlloca(llvm::Function *theFunction,
+                                                 SymbolId var,
+                                                 llvm::Type *type)
+        {
+            llvm::IRBuilder<> tmp(&theFunction->getEntryBlock(),
+                                  theFunction->getEntryBlock().begin());
+            return tmp.CreateAlloca(type, 0, SymbolName(var));
+        }
+
+        // what a declared type keyword is lowered to
+        llvm::Type *LowerType(std::string_view type)
+        {
+            if (type == "int")
+            {
+                return llvm::Type::getInt32Ty(*_context);
+            }
+            if (type == "bool")
+            {
+                return llvm::Type::getInt1Ty(*_context);
+            }
+            if (type == "char")
+            {
+                return llvm::Type::getInt8Ty(*_context);
+            }
+            if (type == "void")
+            {
+                return llvm::Type::getVoidTy(*_context);
+            }
+            return llvm::Type::getFloatTy(*_context);
+        }
+
+        // Every implicit conversion between the types of values goes
+        // through here: a store into a variable, an argument, a return
+        // value, a condition and the operands of an operator. bool is 0 or
+        // 1, char and int are signed, anything is true when it is not zero.
+        llvm::Value *Convert(llvm::Value *v, llvm::Type *to,
+                             const llvm::Twine &name = "convtmp")
+        {
+            auto *from = v->getType();
+            if (from == to)
+            {
+                return v;
+            }
+            if (to->isIntegerTy(1))
+            {
+                if (from->isIntegerTy())
+                {
+                    return _builder.CreateICmpNE(
+                            v, llvm::ConstantInt::get(from, 0), name);
+                }
+                if (from->isFloatingPointTy())
+                {
+                    return _builder.CreateFCmpUNE(
+                            v, llvm::ConstantFP::get(from, 0.0), name);
+                }
+            }
+            else if (to->isIntegerTy())
+            {
+                if (from->isIntegerTy(1))
+                {
+                    return _builder.CreateZExt(v, to, name);
+                }
+                if (from->isIntegerTy())
+                {
+                    return _builder.CreateSExtOrTrunc(v, to, name);
+                }
+                if (from->isFloatingPointTy())
+                {
+                    return _builder.CreateFPToSI(v, to, name);
+                }
+            }
+            else if (to->isFloatingPointTy())
+            {
+                if (from->isIntegerTy(1))
+                {
+                    return _builder.CreateUIToFP(v, to, name);
+                }
+                if (from->isIntegerTy())
+                {
+                    return _builder.CreateSIToFP(v, to, name);
+                }
+                if (from->isFloatingPointTy())
+                {
+                    return _builder.CreateFPCast(v, to, name);
+                }
+            }
+            return LogErrorV("invalid conversion");
+        }
+
+        // The type both operands of an arithmetic operator or comparison
+        // are converted to: float when either is, else int or the wider
+        // integer.
+        llvm::Type *CommonType(llvm::Type *l, llvm::Type *r)
+        {
+            if (l->isFloatingPointTy() || r->isFloatingPointTy())
+            {
+                if (!l->isFloatingPointTy())
+                {
+                    return r;
+                }
+                if (!r->isFloatingPointTy())
+                {
+                    return l;
+                }
+                return l->getPrimitiveSizeInBits() >=
+                       r->getPrimitiveSizeInBits() ? l : r;
+            }
+            auto bits = std::max({l->getIntegerBitWidth(),
+                                  r->getIntegerBitWidth(), 32u});
+            return llvm::Type::getIntNTy(*_context, bits);
+        }
+
+        // arithmetic, bitwise and comparison on generated operands, shared by
+        // the tree and the flat codegen; assignment is handled by the
+        // callers, || and && by EmitShortCircuit.
+        // Operands are converted to their common type, comparisons give a
+        // bool.
+        llvm::Value *EmitBinary(Opcode opcode, llvm::Value *l, llvm::Value *r)
+        {
+            auto *type = CommonType(l->getType(), r->getType());
+            l = Convert(l, type);
+            r = Convert(r, type);
+            if (l == nullptr || r == nullptr)
+            {
+                return nullptr;
+            }
+            if (type->isIntegerTy())
+            {
+                switch (opcode)
+                {
+                    case OpAdd:
+                        return _builder.CreateAdd(l, r, "addtmp");
+                    case OpSub:
+                        return _builder.CreateSub(l, r, "subtmp");
+                    case OpMul:
+                        return _builder.CreateMul(l, r, "multmp");
+                    case OpDiv:
+                        return _builder.CreateSDiv(l, r, "divtmp");
+                    case OpRem:
+                        return _builder.CreateSRem(l, r, "remtmp");
+                    case OpLess:
+                        return _builder.CreateICmpSLT(l, r, "cmptmp");
+                    case OpGreater:
+                        return _builder.CreateICmpSGT(l, r, "cmptmp");
+                    case OpLessEqual:
+                        return _builder.CreateICmpSLE(l, r, "cmptmp");
+                    case OpGreaterEqual:
+                        return _builder.CreateICmpSGE(l, r, "cmptmp");
+                    case OpEqual:
+                        return _builder.CreateICmpEQ(l, r, "cmptmp");
+                    case OpNotEqual:
+                        return _builder.CreateICmpNE(l, r, "cmptmp");
+                    case OpBitOr:
+                        return _builder.CreateOr(l, r, "ortmp");
+                    case OpBitAnd:
+                        return _builder.CreateAnd(l, r, "andtmp");
+                    default:
+                        break;
+                }
+            }
+            else
+            {
+                switch (opcode)
+                {
+                    case OpAdd:
+                        return _builder.CreateFAdd(l, r, "addtmp");
+                    case OpSub:
+                        return _builder.CreateFSub(l, r, "subtmp");
+                    case OpMul:
+                        return _builder.CreateFMul(l, r, "multmp");
+                    case OpDiv:
+                        return _builder.CreateFDiv(l, r, "divtmp");
+                    case OpRem:
+                        return _builder.CreateFRem(l, r, "remtmp");
+                    case OpLess:
+                        return _builder.CreateFCmpULT(l, r, "cmptmp");
+                    case OpGreater:
+                        return _builder.CreateFCmpULT(r, l, "cmptmp");
+                    case OpLessEqual:
+                        return _builder.CreateFCmpULE(l, r, "cmptmp");
+                    case OpGreaterEqual:
+                        return _builder.CreateFCmpULE(r, l, "cmptmp");
+                    case OpEqual:
+                        return _builder.CreateFCmpUEQ(l, r, "cmptmp");
+                    case OpNotEqual:
+                        return _builder.CreateFCmpUNE(l, r, "cmptmp");
+                    default:
+                        break;
+                }
+            }
+            return LogErrorV("invalid binary operator " +
+                             std::string(OpcodeOperator(opcode).spelling));
+        }
+
+        // || and &&: the right operand is generated by emitRight in a block
+        // of its own, which only runs when the left one doesn't decide the
+        // result. Both operands are taken as bools, so is the result.
+        template<typename EmitRight>
+        llvm::Value *EmitShortCircuit(Opcode opcode, llvm::Value *l,
+                                      EmitRight emitRight)
+        {
+            auto *boolType = _builder.getInt1Ty();
+            l = Convert(l, boolType, "booltmp");
+            if (l == nullptr)
+            {
+                return nullptr;
+            }
+            auto *function = _builder.GetInsertBlock()->getParent();
+            auto *leftBlock = _builder.GetInsertBlock();
+            auto *rightBlock = llvm::BasicBlock::Create(*_context, "rhs",
+                                                        function);
+            auto *mergeBlock = llvm::BasicBlock::Create(*_context, "logiccont");
+            bool isOr = opcode == OpOr;
+            if (isOr)
+            {
+                _builder.CreateCondBr(l, mergeBlock, rightBlock);
+            }
+            else
+            {
+                _builder.CreateCondBr(l, rightBlock, mergeBlock);
+            }
+
+            _builder.SetInsertPoint(rightBlock);
+            llvm::Value *r = emitRight();
+            if (r == nullptr)
+            {
+                return nullptr;
+            }
+            r = Convert(r, boolType, "booltmp");
+            if (r == nullptr)
+            {
+                return nullptr;
+            }
+            _builder.CreateBr(mergeBlock);
+            // the right operand may have added blocks of its own
+            rightBlock = _builder.GetInsertBlock();
+
+            function->getBasicBlockList().push_back(mergeBlock);
+            _builder.SetInsertPoint(mergeBlock);
+            auto *pn = _builder.CreatePHI(boolType, 2, "logictmp");
+            pn->addIncoming(_builder.getInt1(isOr), leftBlock);
+            pn->addIncoming(r, rightBlock);
+            return pn;
+        }
+
+        llvm::Value *EmitUnary(Opcode opcode, llvm::Value *v)
+        {
+            auto *type = v->getType();
+            switch (opcode)
+            {
+                case OpNeg:
+                    if (type->isFloatingPointTy())
+                    {
+                        return _builder.CreateFNeg(v, "negtmp");
+                    }
+                    // bool and char are negated as int
+                    v = Convert(v, CommonType(type, type));
+                    return _builder.CreateNeg(v, "negtmp");
+                case OpBitNot:
+                    if (type->isFloatingPointTy())
+                    {
+                        break;
+                    }
+                    v = Convert(v, CommonType(type, type));
+                    return _builder.CreateNot(v, "nottmp");
+                case OpNot:
+                    if (type->isFloatingPointTy())
+                    {
+                        return _builder.CreateFCmpUEQ(
+                                v, llvm::ConstantFP::get(type, 0.0), "nottmp");
+                    }
+                    return _builder.CreateICmpEQ(
+                            v, llvm::ConstantInt::get(type, 0), "nottmp");
+                default:
+                    break;
+            }
+            return LogErrorV("invalid unary operator " +
+                             std::string(OpcodeOperator(opcode).spelling));
+        }
+
+        // assign to a variable, the value stored is what the assignment gives
+        llvm::Value *EmitStore(llvm::Value *v, llvm::AllocaInst *alloca)
+        {
+            v = Convert(v, alloca->getAllocatedType());
+            if (v != nullptr)
+            {
+                _builder.CreateStore(v, alloca);
+            }
+            return v;
+        }
+
+        // The value of an if: the values of both branches converted to one
+        // type at the end of the blocks they come from, joined in the
+        // current block.
+        llvm::Value *EmitPhi(llvm::Value *thenVal, llvm::BasicBlock *thenBlock,
+                             llvm::Value *elseVal, llvm::BasicBlock *elseBlock)
+        {
+            auto *type = thenVal->getType();
+            if (type != elseVal->getType())
+            {
+                type = CommonType(type, elseVal->getType());
+                auto *mergeBlock = _builder.GetInsertBlock();
+                _builder.SetInsertPoint(thenBlock->getTerminator());
+                thenVal = Convert(thenVal, type);
+                _builder.SetInsertPoint(elseBlock->getTerminator());
+                elseVal = Convert(elseVal, type);
+                _builder.SetInsertPoint(mergeBlock);
+                if (thenVal == nullptr || elseVal == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+            llvm::PHINode *pn = _builder.CreatePHI(type, 2, "iftmp");
+            pn->addIncoming(thenVal, thenBlock);
+            pn->addIncoming(elseVal, elseBlock);
+            return pn;
+        }
+
+        // a call whose arguments are converted to the parameter types,
+        // NoValue() when the callee returns nothing
+        llvm::Value *EmitCall(llvm::Function *callee,
+                              std::vector<llvm::Value *> &args)
+        {
+            auto *type = callee->getFunctionType();
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                args[i] = Convert(args[i], type->getParamType(i));
+                if (args[i] == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+            if (type->getReturnType()->isVoidTy())
+            {
+                _builder.CreateCall(callee, args);
+                return _noValue;
+            }
+            return _builder.CreateCall(callee, args, "calltmp");
+        }
+
+        // return the value of a function's body as its return type
+        bool EmitReturn(llvm::Value *v, llvm::Function *function)
+        {
+            auto *type = function->getReturnType();
+            if (type->isVoidTy())
+            {
+                _builder.CreateRetVoid();
+                return true;
+            }
+            v = Convert(v, type);
+            if (v == nullptr)
+            {
+                return false;
+            }
+            _builder.CreateRet(v);
+            return true;
+        }
+
+    private:
+        // declared first, everything below lives in it
+        std::unique_ptr<llvm::LLVMContext> _context;
+        llvm::IRBuilder<> _builder;
+        std::unique_ptr<llvm::Module> _module;
+        // null unless EnableCleanup(), destroyed before the module
+        std::unique_ptr<llvm::legacy::FunctionPassManager> _cleanup;
+        llvm::DenseMap<SymbolId, llvm::Function *> _functions;
+        ScopedSymbolTable<Variable> _variables;
+        llvm::Value *_noValue;
+    };
+}
+
+#endif //INTERPRETER_CODEGEN_HPP
@@ -0,0 +1,92 @@
+//
+// Errors with source locations.
+//
+
+#ifndef INTERPRETER_DIAGNOSTIC_HPP
+#define INTERPRETER_DIAGNOSTIC_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "CharClass.hpp"
+
+namespace In
+{
+    struct Diagnostic
+    {
+        // byte offset into the source the error was found in
+        size_t offset;
+        std::string message;
+    };
+
+    // Errors of one source, collected while it is parsed and printed together
+    // once it is done, so a single run reports all of them.
+    class Diagnostics
+    {
+    public:
+        void Error(size_t offset, std::string message)
+        {
+            _errors.push_back({offset, std::move(message)});
+        }
+
+        void Append(Diagnostics &&other)
+        {
+            _errors.insert(_errors.end(),
+                           std::make_move_iterator(other._errors.begin()),
+                           std::make_move_iterator(other._errors.end()));
+        }
+
+        [[nodiscard]] bool HasErrors() const
+        { return !_errors.empty(); }
+
+        [[nodiscard]] size_t Count() const
+        { return _errors.size(); }
+
+        // file:line:column: error: message, then the line and a caret
+        void Print(llvm::raw_ostream &os, std::string_view fileName,
+                   std::string_view source)
+        {
+            std::stable_sort(_errors.begin(), _errors.end(),
+                             [](const Diagnostic &a, const Diagnostic &b)
+                             { return a.offset < b.offset; });
+            // errors are in order, so lines are counted in one pass
+            size_t line = 1, lineStart = 0;
+            for (auto &error : _errors)
+            {
+                auto offset = std::min(error.offset, source.size());
+                for (auto eol = FindChar(source, '\n', lineStart);
+                     eol < offset; eol = FindChar(source, '\n', lineStart))
+                {
+                    ++line;
+                    lineStart = eol + 1;
+                }
+                auto lineEnd = FindChar(source, '\n', lineStart);
+                auto text = source.substr(lineStart, lineEnd - lineStart);
+                if (!text.empty() && text.back() == '\r')
+                {
+                    text.remove_suffix(1);
+                }
+                auto column = offset - lineStart;
+                os << fileName << ":" << line << ":" << column + 1
+                   << ": error: " << error.message << "\n"
+                   << llvm::StringRef(text.data(), text.size()) << "\n";
+                // keep tabs so the caret lines up with the text above
+                for (size_t i = 0; i < column && i < text.size(); ++i)
+                {
+                    os << (text[i] == '\t' ? '\t' : ' ');
+                }
+                os << "^\n";
+            }
+        }
+
+    private:
+        std::vector<Diagnostic> _errors;
+    };
+}
+
+#endif //INTERPRETER_DIAGNOSTIC_HPP
@@ -0,0 +1,1212 @@
+//
+// Flat, index based form of the AST.
+//
+
+#ifndef INTERPRETER_FLATAST_HPP
+#define INTERPRETER_FLATAST_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "AST.hpp"
+
+namespace In
+{
+    using NodeId = uint32_t;
+    constexpr NodeId NoNode = UINT32_MAX;
+
+    // One array of the flat AST, either built in memory or a view into a
+    // mapped cache file. Appending to a mapped array copies it first.
+    template<typename T>
+    class FlatArray
+    {
+    public:
+        void Push(const T &item)
+        {
+            Own();
+            _owned.push_back(item);
+            _items = _owned;
+        }
+
+        template<typename Iterator>
+        void Append(Iterator begin, Iterator end)
+        {
+            Own();
+            _owned.insert(_owned.end(), begin, end);
+            _items = _owned;
+        }
+
+        void Map(llvm::ArrayRef<T> items)
+        {
+            _owned.clear();
+            _items = items;
+        }
+
+        [[nodiscard]] llvm::ArrayRef<T> Items() const
+        { return _items; }
+
+        [[nodiscard]] size_t Size() const
+        { return _items.size(); }
+
+        const T &operator[](size_t i) const
+        { return _items[i]; }
+
+    private:
+        void Own()
+        {
+            if (_owned.data() != _items.data())
+            {
+                _owned.assign(_items.begin(), _items.end());
+            }
+        }
+
+        std::vector<T> _owned;
+        llvm::ArrayRef<T> _items;
+    };
+
+    // All nodes of a program in contiguous arrays, addressed by 32-bit ids.
+    // Functions are lowered one at a time in post order, children before
+    // their parent, so each function owns the contiguous id range
+    // [begin, body]. Text is copied into one blob and referenced by offset,
+    // nothing points into the source or the tree it was lowered from.
+    // Symbols are numbered per AST and mapped to the global pool by
+    // Symbol(), so the arrays can be saved and mapped back as they are.
+    class FlatAst
+    {
+    public:
+        enum Kind : uint8_t
+        {
+            Number,
+            String,
+            Bool,
+            Name,
+            Binary,
+            Unary,
+            Call,
+            Assign,
+            SetNewVal,
+            ExprStatement,
+            Block,
+            Empty,
+            Return,
+            If,
+            For
+        };
+
+        // Operands by kind:
+        //   Number                first: bits of the float value, or of
+        //                         the int one when second is 1
+        //   String, Bool          first, second: text
+        //   Name                  first: local symbol
+        //   Binary                first: left, second: right, third: opcode
+        //   Unary                 first: operand, third: opcode
+        //   Call                  first: local symbol, second, third: arguments
+        //   Assign, SetNewVal     first: local symbol, second: value
+        //   Assign                third, fourth: declared type text
+        //   ExprStatement         first: expression or NoNode
+        //   Block                 second, third: statements
+        //   Return                first: expression
+        //   If                    first: condition, second: then, third: else
+        //   For                   first: init, second: condition,
+        //                         third: step or NoNode, fourth: body
+        struct Node
+        {
+            uint32_t first = NoNode, second = NoNode, third = NoNode,
+                    fourth = NoNode;
+        };
+
+        // names are local symbols
+        struct Param
+        {
+            uint32_t typeOffset, typeLength;
+            uint32_t name;
+        };
+
+        struct Function
+        {
+            uint32_t typeOffset, typeLength;
+            uint32_t name;
+            uint32_t firstParam, paramCount;
+            NodeId begin, body;
+        };
+
+        struct SymbolText
+        {
+            uint32_t offset, length;
+        };
+
+        // lower a parsed function, returns its index in Functions()
+        uint32_t Add(const In::Function &function)
+        {
+            Function flat{};
+            std::tie(flat.typeOffset, flat.typeLength) =
+                    AddText(function._type._type);
+            flat.name = LocalSymbol(function._name._id);
+            flat.firstParam = static_cast<uint32_t>(_params.Size());
+            flat.paramCount =
+                    static_cast<uint32_t>(function._params._params.size());
+            for (auto &&[type, name] : function._params._params)
+            {
+                auto [offset, length] = AddText(type._type);
+                _params.Push({offset, length, LocalSymbol(name._id)});
+            }
+            flat.begin = static_cast<NodeId>(_kinds.Size());
+            flat.body = AddStatement(function._body);
+            _functions.Push(flat);
+            return static_cast<uint32_t>(_functions.Size() - 1);
+        }
+
+        // the pooled symbol of a local one
+        [[nodiscard]] SymbolId Symbol(uint32_t local) const
+        { return _symbols[local]; }
+
+        [[nodiscard]] Kind GetKind(NodeId id) const
+        { return _kinds[id]; }
+
+        [[nodiscard]] const Node &GetNode(NodeId id) const
+        { return _nodes[id]; }
+
+        [[nodiscard]] std::string_view Text(uint32_t offset,
+                                            uint32_t length) const
+        { return {_text.Items().data() + offset, length}; }
+
+        // children of a Call or Block, listed by offset and count
+        [[nodiscard]] llvm::ArrayRef<NodeId> List(const Node &node) const
+        {
+            return _lists.Items().slice(node.second, node.third);
+        }
+
+        [[nodiscard]] llvm::ArrayRef<Param> Params(const Function &f) const
+        {
+            return _params.Items().slice(f.firstParam, f.paramCount);
+        }
+
+        [[nodiscard]] llvm::ArrayRef<Function> Functions() const
+        { return _functions.Items(); }
+
+        [[nodiscard]] size_t Size() const
+        { return _kinds.Size(); }
+
+        // visit every node of a function in id order, a plain array scan
+        template<typename Callback>
+        void ForEachNode(const Function &function, Callback &&callback) const
+        {
+            if (function.body == NoNode)
+            {
+                return;
+            }
+            for (NodeId id = function.begin; id <= function.body; ++id)
+            {
+                callback(id, _kinds[id], _nodes[id]);
+            }
+        }
+
+        // Saved form: a header, then every array as it is laid out in memory,
+        // each padded to 8 bytes. Map() points the arrays into the buffer
+        // without copying; only the symbols are interned again. The format is
+        // native endian, a file from another layout or version is rejected.
+        static constexpr uint32_t FormatVersion = 2;
+
+        void Save(llvm::raw_ostream &os, uint64_t key) const
+        {
+            FileHeader header{};
+            std::memcpy(header.magic, "INFA", sizeof(header.magic));
+            header.version = FormatVersion;
+            header.byteOrder = ByteOrderMark;
+            header.key = key;
+            header.counts[0] = static_cast<uint32_t>(_kinds.Size());
+            header.counts[1] = static_cast<uint32_t>(_nodes.Size());
+            header.counts[2] = static_cast<uint32_t>(_lists.Size());
+            header.counts[3] = static_cast<uint32_t>(_params.Size());
+            header.counts[4] = static_cast<uint32_t>(_functions.Size());
+            header.counts[5] = static_cast<uint32_t>(_symbolText.Size());
+            header.counts[6] = static_cast<uint32_t>(_text.Size());
+            os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            SaveArray(os, _kinds.Items());
+            SaveArray(os, _nodes.Items());
+            SaveArray(os, _lists.Items());
+            SaveArray(os, _params.Items());
+            SaveArray(os, _functions.Items());
+            SaveArray(os, _symbolText.Items());
+            SaveArray(os, _text.Items());
+        }
+
+        // false, leaving the AST empty, when the buffer doesn't hold a valid
+        // AST saved with the same key
+        bool Map(std::unique_ptr<llvm::MemoryBuffer> buffer, uint64_t key)
+        {
+            *this = FlatAst();
+            const char *cursor = buffer->getBufferStart();
+            const char *end = buffer->getBufferEnd();
+            FileHeader header{};
+            if (reinterpret_cast<uintptr_t>(cursor) % alignof(FileHeader) ||
+                buffer->getBufferSize() < sizeof(header))
+            {
+                return false;
+            }
+            std::memcpy(&header, cursor, sizeof(header));
+            cursor += sizeof(header);
+            if (std::memcmp(header.magic, "INFA", sizeof(header.magic)) ||
+                header.version != FormatVersion ||
+                header.byteOrder != ByteOrderMark || header.key != key)
+            {
+                return false;
+            }
+            if (!MapArray(_kinds, cursor, end, header.counts[0]) ||
+                !MapArray(_nodes, cursor, end, header.counts[1]) ||
+                !MapArray(_lists, cursor, end, header.counts[2]) ||
+                !MapArray(_params, cursor, end, header.counts[3]) ||
+                !MapArray(_functions, cursor, end, header.counts[4]) ||
+                !MapArray(_symbolText, cursor, end, header.counts[5]) ||
+                !MapArray(_text, cursor, end, header.counts[6]) ||
+                !Validate())
+            {
+                *this = FlatAst();
+                return false;
+            }
+            for (auto &symbol : _symbolText.Items())
+            {
+                auto id = TheSymbols.Intern(Text(symbol.offset, symbol.length));
+                _locals.try_emplace(id, static_cast<uint32_t>(_symbols.size()));
+                _symbols.push_back(id);
+            }
+            _file = std::move(buffer);
+            return true;
+        }
+
+        // symbols called from a function, in order of appearance
+        [[nodiscard]] std::vector<SymbolId> Callees(
+                const Function &function) const
+        {
+            std::vector<SymbolId> callees;
+            ForEachNode(function, [&](NodeId, Kind kind, const Node &node)
+            {
+                if (kind == Call)
+                {
+                    callees.push_back(Symbol(node.first));
+                }
+            });
+            return callees;
+        }
+
+    private:
+        static constexpr uint32_t ByteOrderMark = 0x01020304;
+
+        struct FileHeader
+        {
+            char magic[4];
+            uint32_t version;
+            uint32_t byteOrder;
+            // kinds, nodes, lists, params, functions, symbols, text
+            uint32_t counts[7];
+            uint64_t key;
+        };
+
+        template<typename T>
+        static void SaveArray(llvm::raw_ostream &os, llvm::ArrayRef<T> items)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            auto bytes = items.size() * sizeof(T);
+            os.write(reinterpret_cast<const char *>(items.data()), bytes);
+            os.write_zeros(llvm::alignTo(bytes, 8) - bytes);
+        }
+
+        template<typename T>
+        static bool MapArray(FlatArray<T> &array, const char *&cursor,
+                             const char *end, uint32_t count)
+        {
+            static_assert(alignof(T) <= 8);
+            auto bytes = static_cast<size_t>(count) * sizeof(T);
+            if (static_cast<size_t>(end - cursor) < bytes)
+            {
+                return false;
+            }
+            array.Map({reinterpret_cast<const T *>(cursor), count});
+            cursor += std::min<size_t>(llvm::alignTo(bytes, 8), end - cursor);
+            return true;
+        }
+
+        // Every offset, index and slice in the arrays is checked against the
+        // array it points into, so a corrupted file with the right key is
+        // rejected instead of read out of bounds.
+        bool Validate() const
+        {
+            if (_nodes.Size() != _kinds.Size())
+            {
+                return false;
+            }
+            auto inText = [&](uint32_t offset, uint32_t length)
+            { return uint64_t(offset) + length <= _text.Size(); };
+            for (auto &symbol : _symbolText.Items())
+            {
+                if (!inText(symbol.offset, symbol.length))
+                {
+                    return false;
+                }
+            }
+            for (auto &param : _params.Items())
+            {
+                if (!inText(param.typeOffset, param.typeLength) ||
+                    param.name >= _symbolText.Size())
+                {
+                    return false;
+                }
+            }
+            for (auto &f : _functions.Items())
+            {
+                if (!inText(f.typeOffset, f.typeLength) ||
+                    f.name >= _symbolText.Size() ||
+                    uint64_t(f.firstParam) + f.paramCount > _params.Size() ||
+                    (f.body != NoNode &&
+                     (f.begin > f.body || f.body >= _nodes.Size())))
+                {
+                    return false;
+                }
+            }
+            for (NodeId id = 0; id < _nodes.Size(); ++id)
+            {
+                if (!ValidNode(id, inText))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Every index a node holds is in range. Children come before their
+        // parent, so walking from a function's body always ends.
+        template<typename InText>
+        bool ValidNode(NodeId id, InText &inText) const
+        {
+            auto &node = _nodes[id];
+            auto child = [id](NodeId c)
+            { return c < id; };
+            auto optional = [id](NodeId c)
+            { return c == NoNode || c < id; };
+            auto symbol = [&](uint32_t local)
+            { return local < _symbolText.Size(); };
+            auto opcode = [](uint32_t op)
+            { return op != OpNone && op < OpcodeCount; };
+            auto list = [&]
+            {
+                if (uint64_t(node.second) + node.third > _lists.Size())
+                {
+                    return false;
+                }
+                auto items = List(node);
+                return std::all_of(items.begin(), items.end(), child);
+            };
+            switch (_kinds[id])
+            {
+                case Number:
+                case Empty:
+                    return true;
+                case String:
+                case Bool:
+                    return inText(node.first, node.second);
+                case Name:
+                    return symbol(node.first);
+                case Binary:
+                    return child(node.first) && child(node.second) &&
+                           opcode(node.third);
+                case Unary:
+                    return child(node.first) && opcode(node.third);
+                case Call:
+                    return symbol(node.first) && list();
+                case Assign:
+                    return symbol(node.first) && child(node.second) &&
+                           inText(node.third, node.fourth);
+                case SetNewVal:
+                    return symbol(node.first) && child(node.second);
+                case ExprStatement:
+                    return optional(node.first);
+                case Block:
+                    return list();
+                case Return:
+                    return child(node.first);
+                case If:
+                    return child(node.first) && child(node.second) &&
+                           optional(node.third);
+                case For:
+                    return child(node.first) && child(node.second) &&
+                           optional(node.third) && child(node.fourth);
+            }
+            // not a kind at all
+            return false;
+        }
+
+        std::pair<uint32_t, uint32_t> AddText(std::string_view text)
+        {
+            auto offset = static_cast<uint32_t>(_text.Size());
+            _text.Append(text.begin(), text.end());
+            return {offset, static_cast<uint32_t>(text.size())};
+        }
+
+        uint32_t LocalSymbol(SymbolId id)
+        {
+            auto [it, inserted] = _locals.try_emplace(
+                    id, static_cast<uint32_t>(_symbols.size()));
+            if (inserted)
+            {
+                auto [offset, length] = AddText(TheSymbols.Name(id));
+                _symbolText.Push({offset, length});
+                _symbols.push_back(id);
+            }
+            return it->second;
+        }
+
+        // children are lowered first, they may hold lists themselves
+        std::pair<uint32_t, uint32_t> AddList(const std::vector<NodeId> &ids)
+        {
+            auto first = static_cast<uint32_t>(_lists.Size());
+            _lists.Append(ids.begin(), ids.end());
+            return {first, static_cast<uint32_t>(ids.size())};
+        }
+
+        NodeId Push(Kind kind, Node node)
+        {
+            _kinds.Push(kind);
+            _nodes.Push(node);
+            return static_cast<NodeId>(_kinds.Size() - 1);
+        }
+
+        NodeId PushText(Kind kind, std::string_view text)
+        {
+            auto [offset, length] = AddText(text);
+            return Push(kind, {offset, length});
+        }
+
+        NodeId AddExpression(Expression *expr)
+        {
+            if (auto *name = dynamic_cast<Identifier *>(expr))
+            {
+                return Push(Name, {LocalSymbol(name->_id)});
+            }
+            if (auto *binary = dynamic_cast<BinaryOp *>(expr))
+            {
+                auto left = AddExpression(binary->_left);
+                auto right = AddExpression(binary->_right);
+                return Push(Binary, {left, right, binary->_op});
+            }
+            if (auto *unary = dynamic_cast<UnaryOp *>(expr))
+            {
+                auto val = AddExpression(unary->_val);
+                return Push(Unary, {val, NoNode, unary->_op});
+            }
+            if (auto *number = dynamic_cast<NumberLiteral *>(expr))
+            {
+                if (number->_integer)
+                {
+                    return Push(Number,
+                                {std::bit_cast<uint32_t>(number->_int), 1});
+                }
+                return Push(Number, {std::bit_cast<uint32_t>(number->_val), 0});
+            }
+            if (auto *str = dynamic_cast<StringLiteral *>(expr))
+            {
+                return PushText(String, str->_val);
+            }
+            if (auto *boolean = dynamic_cast<BoolLiteral *>(expr))
+            {
+                return PushText(Bool, boolean->_val);
+            }
+            if (auto *call = dynamic_cast<In::Call *>(expr))
+            {
+                std::vector<NodeId> args;
+                for (auto *arg : call->_args._exprs)
+                {
+                    args.push_back(AddExpression(arg));
+                }
+                auto [first, count] = AddList(args);
+                return Push(Call, {LocalSymbol(call->_identifier._id), first,
+                                   count});
+            }
+            if (auto *assign = dynamic_cast<In::Assign *>(expr))
+            {
+                auto val = AddExpression(assign->_val);
+                auto [offset, length] = AddText(assign->_type._type);
+                return Push(Assign, {LocalSymbol(assign->_name._id), val,
+                                     offset, length});
+            }
+            if (auto *set = dynamic_cast<In::SetNewVal *>(expr))
+            {
+                auto val = AddExpression(set->_val);
+                return Push(SetNewVal, {LocalSymbol(set->_name._id), val});
+            }
+            Boom("can't lower expression");
+            return NoNode;
+        }
+
+        NodeId AddStatement(Statement *stmt)
+        {
+            if (stmt == nullptr)
+            {
+                return NoNode;
+            }
+            if (dynamic_cast<EmptyStatement *>(stmt) ||
+                dynamic_cast<While *>(stmt))
+            {
+                return Push(Empty, {});
+            }
+            if (auto *ret = dynamic_cast<In::Return *>(stmt))
+            {
+                return Push(Return, {AddExpression(ret->_expr)});
+            }
+            if (auto *branch = dynamic_cast<In::If *>(stmt))
+            {
+                auto cond = AddExpression(branch->_cond);
+                auto conseq = AddStatement(branch->_conseq);
+                auto alt = AddStatement(branch->_alt);
+                return Push(If, {cond, conseq, alt});
+            }
+            if (auto *loop = dynamic_cast<In::For *>(stmt))
+            {
+                auto init = AddExpression(loop->_init);
+                auto cond = AddExpression(loop->_condition);
+                auto step = loop->_step ? AddExpression(loop->_step) : NoNode;
+                auto body = AddStatement(loop->_body);
+                return Push(For, {init, cond, step, body});
+            }
+            if (auto *block = dynamic_cast<In::Block *>(stmt))
+            {
+                std::vector<NodeId> stmts;
+                stmts.reserve(block->_stmts.size());
+                for (auto *child : block->_stmts)
+                {
+                    stmts.push_back(AddStatement(child));
+                }
+                auto [first, count] = AddList(stmts);
+                return Push(Block, {NoNode, first, count});
+            }
+            auto expr = stmt->_expr ? AddExpression(stmt->_expr) : NoNode;
+            return Push(ExprStatement, {expr});
+        }
+
+        FlatArray<Kind> _kinds;
+        FlatArray<Node> _nodes;
+        // call arguments and block statements, nodes refer to a slice
+        FlatArray<NodeId> _lists;
+        FlatArray<Param> _params;
+        FlatArray<Function> _functions;
+        // names of the local symbols, in _text
+        FlatArray<SymbolText> _symbolText;
+        FlatArray<char> _text;
+        // local symbol to pooled and back
+        std::vector<SymbolId> _symbols;
+        llvm::DenseMap<SymbolId, uint32_t> _locals;
+        // the cache file the arrays are mapped from
+        std::unique_ptr<llvm::MemoryBuffer> _file;
+    };
+
+    // Dispatches on the node kind with a switch instead of a virtual call,
+    // Derived implements one Visit<Kind>(id, node) per kind.
+    template<typename Derived, typename Result>
+    class FlatVisitor
+    {
+    public:
+        explicit FlatVisitor(const FlatAst &ast) : _ast(ast)
+        {}
+
+        Result Visit(NodeId id)
+        {
+            auto &self = static_cast<Derived &>(*this);
+            const auto &node = _ast.GetNode(id);
+            switch (_ast.GetKind(id))
+            {
+                case FlatAst::Number:
+                    return self.VisitNumber(id, node);
+                case FlatAst::String:
+                    return self.VisitString(id, node);
+                case FlatAst::Bool:
+                    return self.VisitBool(id, node);
+                case FlatAst::Name:
+                    return self.VisitName(id, node);
+                case FlatAst::Binary:
+                    return self.VisitBinary(id, node);
+                case FlatAst::Unary:
+                    return self.VisitUnary(id, node);
+                case FlatAst::Call:
+                    return self.VisitCall(id, node);
+                case FlatAst::Assign:
+                    return self.VisitAssign(id, node);
+                case FlatAst::SetNewVal:
+                    return self.VisitSetNewVal(id, node);
+                case FlatAst::ExprStatement:
+                    return self.VisitExprStatement(id, node);
+                case FlatAst::Block:
+                    return self.VisitBlock(id, node);
+                case FlatAst::Empty:
+                    return self.VisitEmpty(id, node);
+                case FlatAst::Return:
+                    return self.VisitReturn(id, node);
+                case FlatAst::If:
+                    return self.VisitIf(id, node);
+                case FlatAst::For:
+                    return self.VisitFor(id, node);
+            }
+            Boom("bad node kind");
+            return Result();
+        }
+
+    protected:
+        std::string_view Text(uint32_t offset, uint32_t length) const
+        { return _ast.Text(offset, length); }
+
+        const FlatAst &_ast;
+    };
+
+    // same text as the tree's Print()
+    class FlatPrinter : public FlatVisitor<FlatPrinter, void>
+    {
+    public:
+        FlatPrinter(const FlatAst &ast, llvm::raw_ostream &os) :
+                FlatVisitor(ast), _os(os)
+        {
+        }
+
+        void Function(const FlatAst::Function &f)
+        {
+            Write(Text(f.typeOffset, f.typeLength));
+            _os << " " << SymbolName(_ast.Symbol(f.name)) << " (";
+            bool first = true;
+            for (auto &param : _ast.Params(f))
+            {
+                if (!first)
+                {
+                    _os << ",";
+                }
+                first = false;
+                Write(Text(param.typeOffset, param.typeLength));
+                _os << " " << SymbolName(_ast.Symbol(param.name));
+            }
+            _os << ")\n{\n";
+            if (f.body != NoNode)
+            {
+                Visit(f.body);
+            }
+            _os << "}\n";
+        }
+
+        void VisitNumber(NodeId, const FlatAst::Node &node)
+        {
+            if (node.second == 1)
+            {
+                _os << std::bit_cast<int32_t>(node.first);
+                return;
+            }
+            _os << llvm::format("%g", std::bit_cast<float>(node.first));
+        }
+
+        void VisitString(NodeId, const FlatAst::Node &node)
+        { Write(Text(node.first, node.second)); }
+
+        void VisitBool(NodeId, const FlatAst::Node &node)
+        { Write(Text(node.first, node.second)); }
+
+        void VisitName(NodeId, const FlatAst::Node &node)
+        { _os << SymbolName(_ast.Symbol(node.first)); }
+
+        void VisitBinary(NodeId, const FlatAst::Node &node)
+        {
+            auto op = static_cast<Opcode>(node.third);
+            Operand(op, node.first, false);
+            _os << " ";
+            Write(OpcodeOperator(op).spelling);
+            _os << " ";
+            Operand(op, node.second, true);
+        }
+
+        void VisitUnary(NodeId, const FlatAst::Node &node)
+        {
+            Write(OpcodeOperator(static_cast<Opcode>(node.third)).spelling);
+            _os << " ";
+            Operand(static_cast<Opcode>(node.third), node.first, true);
+        }
+
+        void VisitCall(NodeId, const FlatAst::Node &node)
+        {
+            _os << SymbolName(_ast.Symbol(node.first)) << "(";
+            bool first = true;
+            for (auto arg : _ast.List(node))
+            {
+                if (!first)
+                {
+                    _os << ",";
+                }
+                first = false;
+                Visit(arg);
+            }
+            _os << ")";
+        }
+
+        void VisitAssign(NodeId, const FlatAst::Node &node)
+        {
+            _os << SymbolName(_ast.Symbol(node.first)) << " = ";
+            Visit(node.second);
+        }
+
+        void VisitSetNewVal(NodeId id, const FlatAst::Node &node)
+        { VisitAssign(id, node); }
+
+        void VisitExprStatement(NodeId, const FlatAst::Node &node)
+        {
+            if (node.first != NoNode)
+            {
+                Visit(node.first);
+                _os << ";\n";
+            }
+        }
+
+        void VisitBlock(NodeId, const FlatAst::Node &node)
+        {
+            for (auto stmt : _ast.List(node))
+            {
+                Visit(stmt);
+                _os << "\n";
+            }
+        }
+
+        void VisitEmpty(NodeId, const FlatAst::Node &)
+        { _os << "Empty Statement"; }
+
+        void VisitReturn(NodeId, const FlatAst::Node &node)
+        {
+            _os << "return ";
+            Visit(node.first);
+            _os << ";";
+        }
+
+        void VisitIf(NodeId, const FlatAst::Node &node)
+        {
+            _os << "if(";
+            Visit(node.first);
+            _os << ")\n{\n";
+            Visit(node.second);
+            _os << "\n}\n";
+            if (node.third != NoNode)
+            {
+                _os << "else\n{\n";
+                Visit(node.third);
+                _os << "\n}\n";
+            }
+        }
+
+        void VisitFor(NodeId, const FlatAst::Node &node)
+        {
+            _os << "for(";
+            Visit(node.first);
+            _os << ";";
+            Visit(node.second);
+            _os << ";";
+            if (node.third != NoNode)
+            {
+                Visit(node.third);
+            }
+            _os << ")\n{\n";
+            Visit(node.fourth);
+            _os << "\n}\n";
+        }
+
+    private:
+        void Write(std::string_view text)
+        { _os << llvm::StringRef(text.data(), text.size()); }
+
+        void Operand(Opcode parent, NodeId operand, bool right)
+        {
+            bool parens = _ast.GetKind(operand) == FlatAst::Binary &&
+                          NeedsParens(parent, static_cast<Opcode>(
+                                  _ast.GetNode(operand).third), right);
+            if (parens)
+            {
+                _os << "(";
+            }
+            Visit(operand);
+            if (parens)
+            {
+                _os << ")";
+            }
+        }
+
+        llvm::raw_ostream &_os;
+    };
+
+    // emits the same IR as the tree's codegen()
+    class FlatCodegen : public FlatVisitor<FlatCodegen, llvm::Value *>
+    {
+    public:
+        FlatCodegen(const FlatAst &ast, CodegenSession &session) :
+                FlatVisitor(ast), _session(session),
+                _builder(session.Builder())
+        {
+        }
+
+        llvm::Function *Function(const FlatAst::Function &f)
+        {
+            auto name = _ast.Symbol(f.name);
+            llvm::Function *theFunction = _session.Functions().lookup(name);
+            if (!theFunction)
+            {
+                theFunction = Prototype(f);
+                _session.Functions()[name] = theFunction;
+            }
+            if (!theFunction->empty())
+            {
+                return (llvm::Function *) LogErrorV(
+                        "Function can't be redefined");
+            }
+            llvm::BasicBlock *bb =
+                    llvm::BasicBlock::Create(_session.Context(), "entry",
+                                             theFunction);
+            _builder.SetInsertPoint(bb);
+            _session.Variables().Clear();
+            auto scope = _session.Variables().Scope();
+            auto params = _ast.Params(f);
+            unsigned index = 0;
+            for (auto &arg : theFunction->args())
+            {
+                // a body regenerated into a kept prototype may rename them
+                auto param = _ast.Symbol(params[index++].name);
+                arg.setName(SymbolName(param));
+                auto *alloca = _session.CreateEntryBlockAlloca(
+                        theFunction, param, arg.getType());
+                _builder.CreateStore(&arg, alloca);
+                _session.Variables().Define(param, {alloca});
+            }
+            llvm::Value *retVal = Visit(f.body);
+            if (retVal != nullptr && _session.EmitReturn(retVal, theFunction))
+            {
+                _session.FinishFunction(*theFunction);
+                return theFunction;
+            }
+            _session.Functions().erase(name);
+            theFunction->deleteBody();
+            // callers kept from an earlier compile may still refer to it
+            if (theFunction->use_empty())
+            {
+                theFunction->eraseFromParent();
+            }
+            return nullptr;
+        }
+
+        llvm::Value *VisitNumber(NodeId, const FlatAst::Node &node)
+        {
+            if (node.second == 1)
+            {
+                return llvm::ConstantInt::get(
+                        llvm::Type::getInt32Ty(_session.Context()),
+                        std::bit_cast<int32_t>(node.first), true);
+            }
+            auto value = std::bit_cast<float>(node.first);
+            return llvm::ConstantFP::get(_session.Context(),
+                                         llvm::APFloat(value));
+        }
+
+        llvm::Value *VisitString(NodeId, const FlatAst::Node &)
+        { return nullptr; }
+
+        llvm::Value *VisitBool(NodeId, const FlatAst::Node &node)
+        {
+            return llvm::ConstantInt::getBool(
+                    _session.Context(),
+                    Text(node.first, node.second) == "true");
+        }
+
+        llvm::Value *VisitName(NodeId, const FlatAst::Node &node)
+        {
+            auto name = _ast.Symbol(node.first);
+            llvm::AllocaInst *v = _session.LookupVariable(name);
+            if (!v)
+            {
+                return LogErrorV("Unknown variable name" +
+                                 std::string(TheSymbols.Name(name)));
+            }
+            return _builder.CreateLoad(v->getAllocatedType(), v,
+                                      SymbolName(name));
+        }
+
+        llvm::Value *VisitBinary(NodeId, const FlatAst::Node &node)
+        {
+            auto op = static_cast<Opcode>(node.third);
+            llvm::Value *l = Visit(node.first);
+            if (l != nullptr && (op == OpOr || op == OpAnd))
+            {
+                return _session.EmitShortCircuit(
+                        op, l, [&]
+                        { return Visit(node.second); });
+            }
+            llvm::Value *r = Visit(node.second);
+            if (!l || !r)
+            {
+                return nullptr;
+            }
+            if (op == OpAssign)
+            {
+                if (_ast.GetKind(node.first) != FlatAst::Name)
+                {
+                    return LogErrorV("invalid assignment target");
+                }
+                return _session.EmitStore(r, _session.LookupVariable(
+                        _ast.Symbol(_ast.GetNode(node.first).first)));
+            }
+            return _session.EmitBinary(op, l, r);
+        }
+
+        llvm::Value *VisitUnary(NodeId, const FlatAst::Node &node)
+        {
+            llvm::Value *v = Visit(node.first);
+            if (v == nullptr)
+            {
+                return nullptr;
+            }
+            return _session.EmitUnary(static_cast<Opcode>(node.third), v);
+        }
+
+        llvm::Value *VisitCall(NodeId, const FlatAst::Node &node)
+        {
+            llvm::Function *calleeF =
+                    _session.Functions().lookup(_ast.Symbol(node.first));
+            if (!calleeF)
+            {
+                return LogErrorV("Unknown function referenced");
+            }
+            auto args = _ast.List(node);
+            if (calleeF->arg_size() != args.size())
+            {
+                return LogErrorV("Incorrect arguments passed");
+            }
+            std::vector<llvm::Value *> argsV;
+            for (auto arg : args)
+            {
+                argsV.push_back(Visit(arg));
+                if (!argsV.back())
+                {
+                    return nullptr;
+                }
+            }
+            return _session.EmitCall(calleeF, argsV);
+        }
+
+        llvm::Value *VisitAssign(NodeId, const FlatAst::Node &node)
+        {
+            auto name = _ast.Symbol(node.first);
+            auto *function = _builder.GetInsertBlock()->getParent();
+            auto *alloca = _session.CreateEntryBlockAlloca(
+                    function, name, DeclaredType(node));
+            auto *val = Visit(node.second);
+            if (val == nullptr)
+            {
+                return nullptr;
+            }
+            val = _session.EmitStore(val, alloca);
+            _session.Variables().Define(name, {alloca});
+            return val;
+        }
+
+        llvm::Value *VisitSetNewVal(NodeId, const FlatAst::Node &node)
+        {
+            auto *val = Visit(node.second);
+            if (val == nullptr)
+            {
+                return nullptr;
+            }
+            return _session.EmitStore(
+                    val, _session.LookupVariable(_ast.Symbol(node.first)));
+        }
+
+        llvm::Value *VisitExprStatement(NodeId, const FlatAst::Node &node)
+        {
+            if (node.first == NoNode)
+            {
+                return nullptr;
+            }
+            return Visit(node.first);
+        }
+
+        llvm::Value *VisitBlock(NodeId, const FlatAst::Node &node)
+        {
+            auto scope = _session.Variables().Scope();
+            // the value of the block is the last one that is not NoValue()
+            llvm::Value *v = _session.NoValue();
+            for (auto stmt : _ast.List(node))
+            {
+                auto *r = Visit(stmt);
+                if (r != _session.NoValue())
+                {
+                    v = r;
+                }
+            }
+            return v;
+        }
+
+        llvm::Value *VisitEmpty(NodeId, const FlatAst::Node &)
+        { return _session.NoValue(); }
+
+        llvm::Value *VisitReturn(NodeId, const FlatAst::Node &node)
+        { return Visit(node.first); }
+
+        llvm::Value *VisitIf(NodeId, const FlatAst::Node &node)
+        {
+            llvm::Value *cond = Visit(node.first);
+            if (cond == nullptr)
+            {
+                return nullptr;
+            }
+            cond = _session.Convert(cond, _builder.getInt1Ty(), "ifcond");
+            if (cond == nullptr)
+            {
+                return nullptr;
+            }
+            llvm::Function *function = _builder.GetInsertBlock()->getParent();
+            auto &context = _session.Context();
+            auto *thenBlock =
+                    llvm::BasicBlock::Create(context, "then", function);
+            auto *mergeBlock = llvm::BasicBlock::Create(context, "ifcont");
+            // without an else a false condition goes straight to the merge
+            auto *elseBlock = node.third != NoNode
+                              ? llvm::BasicBlock::Create(context, "else")
+                              : mergeBlock;
+            _builder.CreateCondBr(cond, thenBlock, elseBlock);
+
+            _builder.SetInsertPoint(thenBlock);
+            llvm::Value *thenVal = Visit(node.second);
+            if (thenVal == nullptr)
+            {
+                return nullptr;
+            }
+            _builder.CreateBr(mergeBlock);
+            thenBlock = _builder.GetInsertBlock();
+
+            if (node.third == NoNode)
+            {
+                function->getBasicBlockList().push_back(mergeBlock);
+                _builder.SetInsertPoint(mergeBlock);
+                return _session.NoValue();
+            }
+            function->getBasicBlockList().push_back(elseBlock);
+            _builder.SetInsertPoint(elseBlock);
+            llvm::Value *elseVal = Visit(node.third);
+            if (elseVal == nullptr)
+            {
+                return nullptr;
+            }
+            _builder.CreateBr(mergeBlock);
+            elseBlock = _builder.GetInsertBlock();
+
+            function->getBasicBlockList().push_back(mergeBlock);
+            _builder.SetInsertPoint(mergeBlock);
+            return _session.EmitPhi(thenVal, thenBlock, elseVal, elseBlock);
+        }
+
+        llvm::Value *VisitFor(NodeId, const FlatAst::Node &node)
+        {
+            if (_ast.GetKind(node.first) != FlatAst::Assign)
+            {
+                return LogErrorV("for loop must start with a declaration");
+            }
+            auto *theFunction = _builder.GetInsertBlock()->getParent();
+            auto &declaration = _ast.GetNode(node.first);
+            SymbolId varName = _ast.Symbol(declaration.first);
+            auto *alloca = _session.CreateEntryBlockAlloca(
+                    theFunction, varName, DeclaredType(declaration));
+            // the loop variable is only in scope of the loop
+            auto scope = _session.Variables().Scope();
+            auto *init = Visit(node.first);
+            if (init == nullptr)
+            {
+                return nullptr;
+            }
+            _session.EmitStore(init, alloca);
+
+            auto *loopBlock =
+                    llvm::BasicBlock::Create(_session.Context(), "loop",
+                                             theFunction);
+            _builder.CreateBr(loopBlock);
+            _builder.SetInsertPoint(loopBlock);
+
+            _session.Variables().Define(varName, {alloca});
+
+            if (Visit(node.fourth) == nullptr)
+            {
+                return nullptr;
+            }
+
+            llvm::Value *stepVal = nullptr;
+            if (node.third != NoNode)
+            {
+                stepVal = Visit(node.third);
+                if (stepVal == nullptr)
+                {
+                    return nullptr;
+                }
+            }
+            else
+            {
+                stepVal = _builder.getInt32(1);
+            }
+
+            auto *endCond = Visit(node.second);
+            if (endCond == nullptr)
+            {
+                return nullptr;
+            }
+            auto *curVar = _builder.CreateLoad(alloca->getAllocatedType(),
+                                              alloca, SymbolName(varName));
+            auto *nextVar = _session.EmitBinary(OpAdd, curVar, stepVal);
+            endCond = _session.Convert(endCond, _builder.getInt1Ty(),
+                                       "loop cond");
+            if (nextVar == nullptr || endCond == nullptr)
+            {
+                return nullptr;
+            }
+            _session.EmitStore(nextVar, alloca);
+
+            auto *afterBlock = llvm::BasicBlock::Create(
+                    _session.Context(), "afterLoop", theFunction);
+            _builder.CreateCondBr(endCond, loopBlock, afterBlock);
+            _builder.SetInsertPoint(afterBlock);
+            return _session.NoValue();
+        }
+
+        // the type of a function as declared, its prototype is generated
+        // with it
+        llvm::FunctionType *Signature(const FlatAst::Function &f) const
+        {
+            std::vector<llvm::Type *> types;
+            for (auto &param : _ast.Params(f))
+            {
+                types.push_back(_session.LowerType(
+                        Text(param.typeOffset, param.typeLength)));
+            }
+            return llvm::FunctionType::get(
+                    _session.LowerType(Text(f.typeOffset, f.typeLength)), types,
+                    false);
+        }
+
+    private:
+        llvm::Function *Prototype(const FlatAst::Function &f)
+        {
+            return llvm::Function::Create(
+                    Signature(f), llvm::Function::ExternalLinkage,
+                    SymbolName(_ast.Symbol(f.name)), &_session.Module());
+        }
+
+        llvm::Type *DeclaredType(const FlatAst::Node &assign) const
+        { return _session.LowerType(Text(assign.third, assign.fourth)); }
+
+        CodegenSession &_session;
+        llvm::IRBuilder<> &_builder;
+    };
+}
+
+#endif //INTERPRETER_FLATAST_HPP
@@ -0,0 +1,438 @@
+//
+// Incremental recompilation of edited sources.
+//
+
+#ifndef INTERPRETER_INCREMENTAL_HPP
+#define INTERPRETER_INCREMENTAL_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include "Diagnostic.hpp"
+#include "FlatAST.hpp"
+#include "Parse.hpp"
+
+namespace In
+{
+    struct SourceText
+    {
+        std::string_view fileName;
+        std::string_view text;
+    };
+
+    // Keeps the module of a session up to date with a set of sources as they
+    // are edited.
+    //
+    // A source is cut into top-level declarations by brace matching, and a
+    // declaration is only parsed again when its tokens changed. A function
+    // is only generated again when its fingerprint changed: the hash of its
+    // declaration's tokens and the signatures of its callees, so callers
+    // follow a callee whose signature changed. Bodies are regenerated into
+    // the prototypes they had, which keeps the calls of unchanged functions
+    // valid, and the module is kept in source order, as a full compile
+    // leaves it.
+    class IncrementalBuild
+    {
+    public:
+        struct Stats
+        {
+            size_t parsed = 0, generated = 0, removed = 0, functions = 0;
+        };
+
+        explicit IncrementalBuild(CodegenSession &session,
+                                  unsigned threads =
+                                          std::thread::hardware_concurrency())
+                : _session(session), _threads(threads)
+        {
+        }
+
+        // false when a source has errors, they are printed and the module
+        // keeps the code of the last update that succeeded
+        bool Update(const std::vector<SourceText> &sources, Stats &stats)
+        {
+            stats = Stats();
+            std::vector<FileState> files(sources.size());
+            Diagnostics diagnostics;
+            bool failed = false;
+            for (size_t i = 0; i < sources.size(); ++i)
+            {
+                auto &source = sources[i];
+                files[i] = Split(source, diagnostics, stats);
+                if (diagnostics.HasErrors())
+                {
+                    diagnostics.Print(llvm::errs(), source.fileName,
+                                      source.text);
+                    diagnostics = Diagnostics();
+                    failed = true;
+                }
+            }
+            if (failed)
+            {
+                return false;
+            }
+            Generate(files, stats);
+            _files = std::move(files);
+            return true;
+        }
+
+    private:
+        struct Declaration
+        {
+            uint64_t tokens;
+            // the functions of the declaration, none for a global
+            FlatAst ast;
+            // what each function calls
+            std::vector<std::vector<SymbolId>> callees;
+        };
+
+        struct FileState
+        {
+            std::string name;
+            uint64_t hash = 0;
+            // a copy to diff the next version against
+            std::string text;
+            // where each declaration starts in text
+            std::vector<size_t> starts;
+            std::vector<std::shared_ptr<Declaration>> declarations;
+        };
+
+        struct FunctionState
+        {
+            uint64_t fingerprint;
+            llvm::Function *function;
+        };
+
+        // The declarations of a source. Only the text between the first and
+        // the last byte that differ from the last version of the file is
+        // lexed again, widened to whole declarations; those before and after
+        // are kept as they were. A changed declaration whose tokens are the
+        // same as one of the last update is not parsed again.
+        FileState Split(const SourceText &source, Diagnostics &diagnostics,
+                        Stats &stats)
+        {
+            FileState file;
+            file.name = std::string(source.fileName);
+            file.hash = llvm::xxHash64({source.text.data(),
+                                        source.text.size()});
+            file.text = std::string(source.text);
+            for (auto &old : _files)
+            {
+                if (old.hash == file.hash)
+                {
+                    file.starts = old.starts;
+                    file.declarations = old.declarations;
+                    return file;
+                }
+            }
+
+            const FileState *old = nullptr;
+            for (auto &candidate : _files)
+            {
+                if (candidate.name == file.name)
+                {
+                    old = &candidate;
+                }
+            }
+            std::string_view text = file.text;
+            // old declarations [0, first) and [last, count) are kept, the
+            // text of the others is now [begin, end)
+            size_t first = 0, last = 0, count = 0;
+            size_t begin = 0, end = text.size();
+            if (old != nullptr)
+            {
+                std::string_view before = old->text;
+                auto limit = std::min(before.size(), text.size());
+                size_t prefix = 0, suffix = 0;
+                while (prefix < limit && before[prefix] == text[prefix])
+                {
+                    ++prefix;
+                }
+                while (suffix < limit - prefix &&
+                       before[before.size() - 1 - suffix] ==
+                       text[text.size() - 1 - suffix])
+                {
+                    ++suffix;
+                }
+                auto &starts = old->starts;
+                count = starts.size();
+                // a declaration is kept when it ends before the change
+                first = std::upper_bound(starts.begin(), starts.end(), prefix)
+                        - starts.begin();
+                first = first > 0 ? first - 1 : 0;
+                last = std::lower_bound(starts.begin() + first, starts.end(),
+                                        before.size() - suffix)
+                       - starts.begin();
+                // an edit above the first declaration is lexed from the
+                // start of the file
+                begin = first > 0 ? starts[first] : 0;
+                end = last < count ? starts[last] + text.size() - before.size()
+                                   : text.size();
+            }
+
+            TokenBuffer tokens;
+            std::vector<size_t> starts;
+            bool kept = Lex(text, begin, end, tokens);
+            if (kept)
+            {
+                bool open = false;
+                starts = DeclarationStarts(tokens, &open);
+                kept = !open || last == count;
+            }
+            if (!kept)
+            {
+                // the change reaches past the declarations around it
+                first = last = count = begin = 0;
+                end = text.size();
+                tokens = Tokenize(text, _threads);
+                starts = DeclarationStarts(tokens);
+            }
+
+            for (size_t i = 0; i < first; ++i)
+            {
+                file.starts.push_back(old->starts[i]);
+                file.declarations.push_back(old->declarations[i]);
+            }
+            std::string spelling;
+            for (size_t i = 0; i < starts.size(); ++i)
+            {
+                auto stop = i + 1 < starts.size() ? starts[i + 1] : end;
+                spelling.clear();
+                for (size_t t = tokens.LowerBound(starts[i]);
+                     t < tokens.Size() && tokens[t].GetOffset() < stop; ++t)
+                {
+                    auto token = tokens[t];
+                    spelling.append(text, token.GetOffset(),
+                                    token.GetLength());
+                    spelling.push_back('\0');
+                }
+                file.starts.push_back(starts[i]);
+                auto hash = llvm::xxHash64(spelling);
+                // declarations are never changed, equal ones can be shared
+                auto reused = _declarations.find(hash);
+                if (reused != _declarations.end())
+                {
+                    file.declarations.push_back(reused->second);
+                    continue;
+                }
+                file.declarations.push_back(
+                        ParseDeclaration(text, starts[i], stop, hash,
+                                         diagnostics));
+                ++stats.parsed;
+            }
+            for (size_t i = last; i < count; ++i)
+            {
+                file.starts.push_back(old->starts[i] + text.size() -
+                                      old->text.size());
+                file.declarations.push_back(old->declarations[i]);
+            }
+            return file;
+        }
+
+        // The tokens starting in [begin, end) of text, lexed as part of all
+        // of it. False when no token starts right at end: a comment, string
+        // or token from the range runs into what comes after it.
+        static bool Lex(std::string_view text, size_t begin, size_t end,
+                        TokenBuffer &tokens)
+        {
+            Lexer lexer(text, begin, text.size());
+            while (!lexer.AtEnd() && lexer.Peek().GetOffset() < end)
+            {
+                tokens.PushBack(lexer.Peek());
+                lexer.Next();
+            }
+            return lexer.Peek().GetOffset() == end;
+        }
+
+        std::shared_ptr<Declaration> ParseDeclaration(
+                std::string_view text, size_t begin, size_t end,
+                uint64_t hash, Diagnostics &diagnostics)
+        {
+            auto declaration = std::make_shared<Declaration>();
+            declaration->tokens = hash;
+            AstArena arena;
+            Parse parse(text, begin, end, arena);
+            for (auto *function : parse.ParseProgram())
+            {
+                auto &ast = declaration->ast;
+                auto index = ast.Add(*function);
+                declaration->callees.push_back(
+                        ast.Callees(ast.Functions()[index]));
+            }
+            diagnostics.Append(std::move(parse.GetDiagnostics()));
+            return declaration;
+        }
+
+        void Generate(const std::vector<FileState> &files, Stats &stats)
+        {
+            struct Pending
+            {
+                const FlatAst *ast;
+                const FlatAst::Function *function;
+                SymbolId name;
+                // declaration's tokens, index of the function in it
+                uint64_t tokens, index;
+                llvm::ArrayRef<SymbolId> callees;
+                uint64_t fingerprint;
+            };
+            std::vector<Pending> functions;
+            // the signature of every function, the first definition wins
+            llvm::DenseMap<SymbolId, llvm::FunctionType *> signatures;
+            for (auto &file : files)
+            {
+                for (auto &declaration : file.declarations)
+                {
+                    auto &ast = declaration->ast;
+                    FlatCodegen codegen(ast, _session);
+                    auto list = ast.Functions();
+                    for (size_t i = 0; i < list.size(); ++i)
+                    {
+                        auto name = ast.Symbol(list[i].name);
+                        // the fingerprint needs every signature, it is
+                        // filled in below
+                        functions.push_back({&ast, &list[i], name,
+                                             declaration->tokens, i,
+                                             declaration->callees[i], 0});
+                        signatures.try_emplace(name, codegen.Signature(list[i]));
+                    }
+                }
+            }
+            stats.functions = functions.size();
+
+            std::vector<uint64_t> key;
+            for (auto &pending : functions)
+            {
+                key.assign({pending.tokens, pending.index});
+                // types are unique in their context, which outlives the build
+                for (auto callee : pending.callees)
+                {
+                    key.push_back(callee);
+                    key.push_back(reinterpret_cast<uintptr_t>(
+                            signatures.lookup(callee)));
+                }
+                pending.fingerprint = llvm::xxHash64(llvm::ArrayRef<uint8_t>(
+                        reinterpret_cast<const uint8_t *>(key.data()),
+                        key.size() * sizeof(uint64_t)));
+            }
+
+            // Drop the bodies of everything that changed first. Calls into a
+            // function whose signature changed or that is gone only come from
+            // changed functions, so none are left when it is erased.
+            llvm::DenseMap<SymbolId, uint64_t> current;
+            for (auto &pending : functions)
+            {
+                current.try_emplace(pending.name, pending.fingerprint);
+            }
+            std::vector<SymbolId> changed, removed;
+            for (auto &[name, state] : _functions)
+            {
+                auto it = current.find(name);
+                if (it != current.end() && it->second == state.fingerprint)
+                {
+                    continue;
+                }
+                state.function->deleteBody();
+                if (it == current.end() ||
+                    signatures.lookup(name) !=
+                    state.function->getFunctionType())
+                {
+                    removed.push_back(name);
+                }
+                else
+                {
+                    changed.push_back(name);
+                }
+            }
+            for (auto name : removed)
+            {
+                auto *function = _functions.lookup(name).function;
+                _session.Functions().erase(name);
+                if (function->use_empty())
+                {
+                    function->eraseFromParent();
+                }
+                _functions.erase(name);
+                ++stats.removed;
+            }
+            // a changed body goes into a new prototype unchanged callers are
+            // moved to, its values are named as in a fresh compile
+            for (auto name : changed)
+            {
+                auto &state = _functions[name];
+                auto *old = state.function;
+                auto *function = llvm::Function::Create(
+                        old->getFunctionType(), old->getLinkage(), "",
+                        &_session.Module());
+                old->replaceAllUsesWith(function);
+                function->takeName(old);
+                old->eraseFromParent();
+                _session.Functions()[name] = function;
+                state.function = function;
+            }
+
+            llvm::DenseSet<SymbolId> seen;
+            for (auto &pending : functions)
+            {
+                // a redefinition is generated again to report it again
+                bool first = seen.insert(pending.name).second;
+                auto state = _functions.find(pending.name);
+                if (first && state != _functions.end() &&
+                    state->second.fingerprint == pending.fingerprint)
+                {
+                    continue;
+                }
+                auto *function = FlatCodegen(*pending.ast, _session)
+                        .Function(*pending.function);
+                ++stats.generated;
+                if (function != nullptr)
+                {
+                    _functions[pending.name] = {pending.fingerprint, function};
+                }
+                else if (first)
+                {
+                    _functions.erase(pending.name);
+                }
+            }
+
+            // source order, as a compile from scratch would have it
+            auto &list = _session.Module().getFunctionList();
+            for (auto &pending : functions)
+            {
+                if (auto *function = _functions.lookup(pending.name).function)
+                {
+                    list.splice(list.end(), list, function->getIterator());
+                }
+            }
+
+            _declarations.clear();
+            for (auto &file : files)
+            {
+                for (auto &declaration : file.declarations)
+                {
+                    _declarations.try_emplace(declaration->tokens,
+                                              declaration);
+                }
+            }
+        }
+
+        CodegenSession &_session;
+        unsigned _threads;
+        std::vector<FileState> _files;
+        // the declarations of the last update by the hash of their tokens
+        std::unordered_map<uint64_t, std::shared_ptr<Declaration>>
+                _declarations;
+        llvm::DenseMap<SymbolId, FunctionState> _functions;
+    };
+}
+
+#endif //INTERPRETER_INCREMENTAL_HPP
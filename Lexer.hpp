@@ -5,15 +5,30 @@
 #ifndef INTERPRETER_LEXER_HPP
 #define INTERPRETER_LEXER_HPP
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <iostream>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
+#include "CharClass.hpp"
+#include "Symbol.hpp"
+
 namespace In
 {
+    // A token is eight bytes: where its text starts in the source buffer, how
+    // long it is, its kind, and its type packed with flags into the last byte.
+    // The text is read back from the source with TokenText, so the buffer must
+    // outlive every token and the parser.
     class Token
     {
     public:
-        enum Type
+        enum Type : uint8_t
         {
             NumLiteral,
             Char,
@@ -21,221 +36,746 @@ namespace In
             StringLiteral,
             KeyWord,
             Identifier,
-            Symbol
+            Symbol,
+            // bytes that do not form a token, the parser rejects it
+            Invalid,
+            // end of input, Lexer keeps returning it once the source is done
+            End
         };
 
-        [[nodiscard]] std::string TypeToStr(Type type) const
+        // Keywords, operators and symbols each get their own kind so the
+        // parser can dispatch on it, the other tokens are None.
+        enum Kind : uint8_t
         {
-            switch (type)
-            {
-                case NumLiteral:
-                    return "NumLiteral";
-                case Char:
-                    return "Char";
-                case Operator:
-                    return "Operator";
-                case StringLiteral:
-                    return "StringLiteral";
-                case KeyWord:
-                    return "KeyWord";
-                case Identifier:
-                    return "Identifier";
-                case Symbol:
-                    return "Symbol";
-            }
-        }
+            None,
+            // keywords, in the order of keyWords, types first
+            KwChar,
+            KwInt,
+            KwBool,
+            KwVoid,
+            KwFloat,
+            KwIf,
+            KwElse,
+            KwWhile,
+            KwFor,
+            KwContinue,
+            KwBreak,
+            KwSwitch,
+            KwCase,
+            KwDefault,
+            KwReturn,
+            KwTrue,
+            KwFalse,
+            // operators
+            Plus,
+            Minus,
+            Star,
+            Slash,
+            Percent,
+            Assign,
+            Not,
+            Or,
+            And,
+            Greater,
+            Less,
+            Tilde,
+            OrOr,
+            AndAnd,
+            EqualEqual,
+            NotEqual,
+            LessEqual,
+            GreaterEqual,
+            // symbols
+            LBrace,
+            RBrace,
+            LParen,
+            RParen,
+            Semicolon,
+            Colon,
+            Comma
+        };
 
-        Token(Type type, std::string value) : _type(type), _value(std::move(value))
-        {
-        }
+        // longest length stored in the token itself
+        static constexpr size_t MaxLength = 0xFFFF;
 
-        Token(Type type, char value) : _type(type)
-        { _value = value; }
+        Token() = default;
 
-        void Output() const
+        Token(Type type, size_t offset, size_t length, Kind kind = None) :
+                _offset(static_cast<uint32_t>(offset)),
+                _length(static_cast<uint16_t>(std::min(length, MaxLength))),
+                _kind(kind),
+                _flags(static_cast<uint8_t>(
+                        type | (length > MaxLength ? LongFlag : 0u)))
         {
-            std::cout << "type:" << TypeToStr(_type)
-                      << " value:" << _value
-                      << std::endl;
         }
 
         Type GetType() const
-        { return _type; }
+        { return static_cast<Type>(_flags & TypeMask); }
+
+        Kind GetKind() const
+        { return _kind; }
 
-        std::string GetValue() const
-        { return _value; }
+        uint32_t GetOffset() const
+        { return _offset; }
+
+        // clamped to MaxLength for long tokens
+        uint16_t GetLength() const
+        { return _length; }
+
+        // the text was longer than MaxLength, TokenText scans for its end
+        bool IsLong() const
+        { return (_flags & LongFlag) != 0; }
+
+        bool operator==(const Token &other) const = default;
 
     private:
-        Type _type;
-        std::string _value;
+        friend class TokenBuffer;
+
+        static constexpr uint8_t TypeMask = 0x0F;
+        static constexpr uint8_t LongFlag = 0x10;
+
+        uint32_t _offset = 0;
+        uint16_t _length = 0;
+        Kind _kind = None;
+        uint8_t _flags = End;
     };
 
+    static_assert(sizeof(Token) == 8);
+
+    // largest source a token offset can point into, inputs past it are
+    // refused before they get to a lexer
+    constexpr size_t MaxSourceSize = UINT32_MAX;
+
+    std::string_view TypeToStr(Token::Type type)
+    {
+        switch (type)
+        {
+            case Token::NumLiteral:
+                return "NumLiteral";
+            case Token::Char:
+                return "Char";
+            case Token::Operator:
+                return "Operator";
+            case Token::StringLiteral:
+                return "StringLiteral";
+            case Token::KeyWord:
+                return "KeyWord";
+            case Token::Identifier:
+                return "Identifier";
+            case Token::Symbol:
+                return "Symbol";
+            case Token::Invalid:
+                return "Invalid";
+            case Token::End:
+                return "End";
+        }
+        return "";
+    }
+
     void Boom(std::string errorInfo = "")
     {
-        std::cout << "Boom" << std::endl;
+        std::cout << "Boom";
+        if (!errorInfo.empty())
+        {
+            std::cout << ": " << errorInfo;
+        }
+        std::cout << std::endl;
         exit(-1);
     }
 
     bool IsLetter(char c)
     {
-        return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+        return HasCharClass(c, LetterClass);
     }
 
     bool IsOperator(char c)
     {
-        // TODO: == != ... ++ --
-        return std::string_view("+-*/%=!|&><~").find(c) != std::string::npos;
+        return HasCharClass(c, OperatorClass);
     }
 
-    bool IsUnaryOp(char c)
+    bool IsSymbol(char c)
     {
-        return c == '-' || c == '~';
+        return HasCharClass(c, SymbolClass);
     }
 
-    bool IsSymbol(char c)
+    bool IsNum(char c)
+    { return HasCharClass(c, DigitClass); }
+
+    constexpr std::array<std::string_view, Token::KwFalse> keyWords = {
+            "char", "int", "bool", "void", "float",
+            "if", "else", "while", "for", "continue",
+            "break", "switch", "case", "default", "return",
+            "true", "false"};
+
+    // Perfect hash over keyWords, the multipliers were searched so that no two
+    // keywords share a slot. Every keyword has at least two characters.
+    constexpr size_t KeyWordHash(std::string_view s)
     {
-        return std::string_view("{}();:,").find(c) != std::string::npos;
+        return (static_cast<size_t>(s[0]) * 7 + static_cast<size_t>(s[1]) * 9
+                + s.size()) & 31u;
     }
 
-    bool IsNum(char c)
-    { return (c >= '0' && c <= '9'); }
+    // slot -> keyword index + 1, 0 for an empty slot
+    constexpr std::array<uint8_t, 32> MakeKeyWordTable()
+    {
+        std::array<uint8_t, 32> table{};
+        for (size_t i = 0; i < keyWords.size(); ++i)
+        {
+            table[KeyWordHash(keyWords[i])] = static_cast<uint8_t>(i + 1);
+        }
+        return table;
+    }
+
+    inline constexpr std::array<uint8_t, 32> keyWordTable = MakeKeyWordTable();
+
+    constexpr bool KeyWordTableIsPerfect()
+    {
+        size_t used = 0;
+        for (auto slot : keyWordTable)
+        {
+            used += slot != 0;
+        }
+        return used == keyWords.size();
+    }
+
+    static_assert(KeyWordTableIsPerfect(), "keyword hash has a collision");
+
+    constexpr size_t maxKeyWordSize = 8;
+
+    // Token::None when s is not a keyword
+    constexpr Token::Kind KeyWordKind(std::string_view s)
+    {
+        if (s.size() < 2 || s.size() > maxKeyWordSize)
+        {
+            return Token::None;
+        }
+        auto slot = keyWordTable[KeyWordHash(s)];
+        if (slot == 0 || keyWords[slot - 1] != s)
+        {
+            return Token::None;
+        }
+        return static_cast<Token::Kind>(Token::KwChar + slot - 1);
+    }
 
-    std::vector keyWords = {"char", "int", "bool", "void", "float",
-                            "if", "else", "while", "for", "continue",
-                            "break", "switch", "case", "default", "return",
-                            "true", "false"};
+    static_assert(KeyWordKind("return") == Token::KwReturn);
+    static_assert(KeyWordKind("retur") == Token::None);
 
     bool IsKeyWord(std::string_view s)
     {
-        return std::find(keyWords.begin(), keyWords.end(), s) != keyWords.end();
+        return KeyWordKind(s) != Token::None;
+    }
+
+    bool IsTypeKeyWord(Token::Kind kind)
+    {
+        return kind >= Token::KwChar && kind <= Token::KwFloat;
     }
 
-    bool IsTypeKeyWord(std::string_view s)
+    constexpr std::array<Token::Kind, 256> MakePunctuatorTable()
     {
-        for (size_t i = 0; i < 4; ++i)
+        std::array<Token::Kind, 256> table{};
+        auto add = [&](std::string_view chars, Token::Kind first)
         {
-            if (keyWords[i] == s)
+            for (size_t i = 0; i < chars.size(); ++i)
             {
-                return true;
+                table[static_cast<unsigned char>(chars[i])] =
+                        static_cast<Token::Kind>(first + i);
             }
+        };
+        add("+-*/%=!|&><~", Token::Plus);
+        add("{}();:,", Token::LBrace);
+        return table;
+    }
+
+    inline constexpr std::array<Token::Kind, 256> punctuatorTable =
+            MakePunctuatorTable();
+
+    static_assert(punctuatorTable['~'] == Token::Tilde);
+    static_assert(punctuatorTable[','] == Token::Comma);
+
+    inline constexpr std::array<std::string_view,
+            Token::Comma - Token::Plus + 1> punctuatorSpellings = {
+            "+", "-", "*", "/", "%", "=", "!", "|", "&", ">", "<", "~",
+            "||", "&&", "==", "!=", "<=", ">=",
+            "{", "}", "(", ")", ";", ":", ","};
+
+    static_assert(punctuatorSpellings[Token::LessEqual - Token::Plus] == "<=");
+    static_assert(punctuatorSpellings.back() == ",");
+
+    // how a keyword, operator or symbol is written, empty for None
+    std::string_view KindSpelling(Token::Kind kind)
+    {
+        if (kind >= Token::KwChar && kind <= Token::KwFalse)
+        {
+            return keyWords[kind - Token::KwChar];
+        }
+        if (kind >= Token::Plus)
+        {
+            return punctuatorSpellings[kind - Token::Plus];
+        }
+        return "";
+    }
+
+    // kind of a single character operator or symbol
+    Token::Kind PunctuatorKind(char c)
+    {
+        return punctuatorTable[static_cast<unsigned char>(c)];
+    }
+
+    // || && == != <= >=, None for any other pair
+    constexpr Token::Kind TwoCharOperatorKind(char first, char second)
+    {
+        if (second == '=')
+        {
+            switch (first)
+            {
+                case '=':
+                    return Token::EqualEqual;
+                case '!':
+                    return Token::NotEqual;
+                case '<':
+                    return Token::LessEqual;
+                case '>':
+                    return Token::GreaterEqual;
+                default:
+                    return Token::None;
+            }
+        }
+        if (first == second && (first == '|' || first == '&'))
+        {
+            return first == '|' ? Token::OrOr : Token::AndAnd;
         }
-        return false;
+        return Token::None;
     }
 
     bool IsBlank(char c)
     {
-        return std::string_view("\r\n\t ").find(c) != std::string::npos;
+        return HasCharClass(c, BlankClass);
     }
 
     void skip(std::string_view str, char c, size_t &i)
     {
-        while (str[i] != c && i < str.size())
+        i = FindChar(str, c, i);
+    }
+
+    size_t SkipNumber(std::string_view str, size_t i)
+    {
+        while (i < str.size() && (IsNum(str[i]) || str[i] == '.'))
         {
             ++i;
         }
+        return i;
     }
 
-    std::vector<Token> Tokenize(std::string_view str)
+    // the text of a token lexed from source
+    std::string_view TokenText(std::string_view source, Token token)
     {
-        std::vector<Token> tokens;
-        size_t i = 0;
-        while (i < str.size())
+        size_t end = token.GetOffset() + token.GetLength();
+        if (token.IsLong())
         {
-            while (IsBlank(str[i]))
+            // only these grow without bound, scan for the end again
+            switch (token.GetType())
             {
-                ++i;
+                case Token::StringLiteral:
+                    end = FindChar(source, '"', token.GetOffset());
+                    break;
+                case Token::Identifier:
+                    end = SkipIdentifierBody(source, token.GetOffset());
+                    break;
+                case Token::NumLiteral:
+                    end = SkipNumber(source, token.GetOffset());
+                    break;
+                default:
+                    break;
             }
-            switch (str[i])
+        }
+        return source.substr(token.GetOffset(), end - token.GetOffset());
+    }
+
+    void DumpToken(std::ostream &os, std::string_view source, Token token)
+    {
+        os << "type:" << TypeToStr(token.GetType())
+           << " value:" << TokenText(source, token)
+           << std::endl;
+    }
+
+    // A token stream stored column by column. Passes that look only at kinds,
+    // or binary search the offsets, touch one dense array.
+    class TokenBuffer
+    {
+    public:
+        void PushBack(Token token)
+        {
+            _offsets.push_back(token.GetOffset());
+            _lengths.push_back(token.GetLength());
+            _kinds.push_back(token.GetKind());
+            _flags.push_back(token._flags);
+        }
+
+        // tokens [first, other.Size()) of other
+        void Append(const TokenBuffer &other, size_t first)
+        {
+            auto append = [first](auto &to, const auto &from)
             {
-                case '"':
+                to.insert(to.end(), from.begin() + first, from.end());
+            };
+            append(_offsets, other._offsets);
+            append(_lengths, other._lengths);
+            append(_kinds, other._kinds);
+            append(_flags, other._flags);
+        }
+
+        Token operator[](size_t i) const
+        {
+            Token token;
+            token._offset = _offsets[i];
+            token._length = _lengths[i];
+            token._kind = _kinds[i];
+            token._flags = _flags[i];
+            return token;
+        }
+
+        [[nodiscard]] size_t Size() const
+        { return _offsets.size(); }
+
+        // index of the first token starting at or after offset
+        [[nodiscard]] size_t LowerBound(uint32_t offset) const
+        {
+            return std::lower_bound(_offsets.begin(), _offsets.end(), offset)
+                   - _offsets.begin();
+        }
+
+        [[nodiscard]] const std::vector<Token::Kind> &Kinds() const
+        { return _kinds; }
+
+    private:
+        std::vector<uint32_t> _offsets;
+        std::vector<uint16_t> _lengths;
+        std::vector<Token::Kind> _kinds;
+        std::vector<uint8_t> _flags;
+    };
+
+    // Produces tokens on demand instead of lexing the whole source up front.
+    // The parser looks at most LookAhead tokens past the current one, so only
+    // that many are kept, in a ring buffer, and lexing overlaps with parsing.
+    class Lexer
+    {
+    public:
+        // ParseGlobalDeclaration needs LookN(3)
+        static constexpr size_t LookAhead = 3;
+
+        // identifiers are interned into symbols unless it is null
+        explicit Lexer(std::string_view str, SymbolPool *symbols = nullptr) :
+                Lexer(str, 0, str.size(), symbols)
+        {
+        }
+
+        // Only tokens starting in [begin, end) are produced. A token starting
+        // before end may run past it, offsets are always into all of str.
+        Lexer(std::string_view str, size_t begin, size_t end,
+              SymbolPool *symbols = nullptr) :
+                _str(str), _pos(begin), _end(end)
+        {
+            assert(str.size() <= MaxSourceSize && "checked by ReadFile");
+            if (symbols != nullptr)
+            {
+                _symbols.emplace(*symbols);
+            }
+        }
+
+        // Tokens [first, last) of tokens, already lexed from str, instead of
+        // lexing it again. Position() is not kept up.
+        Lexer(std::string_view str, const TokenBuffer &tokens, size_t first,
+              size_t last, SymbolPool *symbols = nullptr) :
+                Lexer(str, 0, 0, symbols)
+        {
+            _tokens = &tokens;
+            _next = first;
+            _last = last;
+        }
+
+        // n tokens past the current one, an End token past the end of input
+        const Token &Peek(size_t n = 0)
+        {
+            assert(n <= LookAhead && "lookahead past the ring buffer");
+            while (_count <= n)
+            {
+                auto slot = (_head + _count) & BufferMask;
+                _buffer[slot] = Lex(_bufferSymbols[slot]);
+                ++_count;
+            }
+            return _buffer[(_head + n) & BufferMask];
+        }
+
+        // interned name of the Identifier token Peek(n)
+        SymbolId PeekSymbol(size_t n = 0)
+        {
+            Peek(n);
+            return _bufferSymbols[(_head + n) & BufferMask];
+        }
+
+        void Next()
+        {
+            Peek();
+            _head = (_head + 1) & BufferMask;
+            --_count;
+        }
+
+        bool AtEnd()
+        {
+            return Peek().GetType() == Token::End;
+        }
+
+        [[nodiscard]] std::string_view Text(Token token) const
+        {
+            return TokenText(_str, token);
+        }
+
+        // Offset just past the last token lexed, or where blanks before the
+        // end of the range stop. Past the end when the last token ran over it.
+        [[nodiscard]] size_t Position() const
+        { return _pos; }
+
+    private:
+        static constexpr size_t BufferSize = std::bit_ceil(LookAhead + 1);
+        static constexpr size_t BufferMask = BufferSize - 1;
+
+        Token Lex(SymbolId &symbol)
+        {
+            if (_tokens != nullptr)
+            {
+                return Replay(symbol);
+            }
+            auto str = _str;
+            auto &i = _pos;
+            while (true)
+            {
+                if (i < _end)
                 {
-                    ++i;
-                    auto first = i;
-                    skip(str, '"', i);
-                    auto s = std::string(str.substr(first, i - first));
-                    tokens.emplace_back(Token::StringLiteral, s);
-                    ++i;
-                    break;
+                    i = SkipBlank(str.substr(0, _end), i);
                 }
-                case '\'':
+                if (i >= _end)
                 {
-                    if (str[i + 2] != '\'')
-                    {
-                        Boom();
-                    }
-                    tokens.emplace_back(Token::Char, str[i + 1]);
-                    i += 2;
-                    break;
+                    return Token(Token::End, str.size(), 0);
                 }
-                case '/':
+                switch (str[i])
                 {
-                    ++i;
-                    if (str[i] != '/')
+                    case '"':
                     {
-                        Boom();
+                        ++i;
+                        auto first = i;
+                        skip(str, '"', i);
+                        auto token =
+                                Token(Token::StringLiteral, first, i - first);
+                        ++i;
+                        return token;
                     }
-                    // TODO:\r \n \r\n
-                    skip(str, '\n', i);
-                }
-                case '#':
-                {
-                    skip(str, '\n', i);
-                }
-                default:
-                {
-                    if (IsLetter(str[i]))
+                    case '\'':
                     {
-                        auto first = i;
-                        while (str[i] != ' ' && !IsSymbol(str[i]) && !IsOperator(str[i]))
+                        if (i + 2 >= str.size() || str[i + 2] != '\'')
                         {
                             ++i;
+                            return Token(Token::Invalid, i - 1, 1);
                         }
-                        auto s = std::string(str.substr(first, i - first));
-                        if (IsKeyWord(s))
-                        {
-                            tokens.emplace_back(Token::KeyWord, s);
-                        }
-                        else
-                        {
-                            tokens.emplace_back(Token::Identifier, s);
-                        }
+                        i += 3;
+                        return Token(Token::Char, i - 2, 1);
                     }
-                    else if (IsOperator(str[i]))
+                    case '/':
                     {
-                        // TODO: == != >= <=
-                        // TODO: Maybe Problem
-                        auto s = str[i];
                         ++i;
-                        if (str[i] == '|' || str[i] == '&')
+                        if (i >= str.size() || str[i] != '/')
                         {
-                            if (str[i] == s)
-                            {
-                                tokens.emplace_back(
-                                        Token::Operator,
-                                        std::string(str.substr(i - 1, 2)));
-                                ++i;
-                                continue;
-                            }
+                            return Token(Token::Operator, i - 1, 1,
+                                         Token::Slash);
                         }
-                        tokens.emplace_back(Token::Operator, s);
+                        // TODO:\r \n \r\n
+                        skip(str, '\n', i);
+                        continue;
                     }
-                    else if (IsSymbol(str[i]))
+                    case '#':
                     {
-                        tokens.emplace_back(Token::Symbol, str[i]);
-                        ++i;
+                        skip(str, '\n', i);
+                        continue;
+                    }
+                    default:
+                        break;
+                }
+                auto first = i;
+                if (IsLetter(str[i]))
+                {
+                    i = SkipIdentifierBody(str, i + 1);
+                    auto s = str.substr(first, i - first);
+                    if (auto kind = KeyWordKind(s); kind != Token::None)
+                    {
+                        return Token(Token::KeyWord, first, i - first, kind);
                     }
-                    else if (IsNum(str[i]))
+                    symbol = _symbols ? _symbols->Intern(s) : 0;
+                    return Token(Token::Identifier, first, i - first);
+                }
+                if (IsOperator(str[i]))
+                {
+                    auto c = str[i];
+                    ++i;
+                    if (i < str.size())
                     {
-                        auto first = i;
-                        while (IsNum(str[i]) || str[i] == '.')
+                        if (auto kind = TwoCharOperatorKind(c, str[i]);
+                                kind != Token::None)
                         {
                             ++i;
+                            return Token(Token::Operator, first, 2, kind);
                         }
-                        auto s = std::string(str.substr(first, i - first));
-                        tokens.emplace_back(Token::NumLiteral, s);
                     }
+                    return Token(Token::Operator, first, 1, PunctuatorKind(c));
+                }
+                if (IsSymbol(str[i]))
+                {
+                    ++i;
+                    return Token(Token::Symbol, first, 1,
+                                 PunctuatorKind(str[first]));
+                }
+                if (IsNum(str[i]))
+                {
+                    i = SkipNumber(str, i);
+                    return Token(Token::NumLiteral, first, i - first);
+                }
+                // not the start of any token
+                ++i;
+                return Token(Token::Invalid, first, 1);
+            }
+        }
+
+        Token Replay(SymbolId &symbol)
+        {
+            if (_next >= _last)
+            {
+                return Token(Token::End, _str.size(), 0);
+            }
+            auto token = (*_tokens)[_next++];
+            if (token.GetType() == Token::Identifier)
+            {
+                symbol = _symbols ? _symbols->Intern(Text(token)) : 0;
+            }
+            return token;
+        }
+
+        std::string_view _str;
+        size_t _pos;
+        size_t _end;
+        std::optional<SymbolCache> _symbols;
+
+        // set when replaying a TokenBuffer
+        const TokenBuffer *_tokens = nullptr;
+        size_t _next = 0;
+        size_t _last = 0;
+
+        std::array<Token, BufferSize> _buffer;
+        std::array<SymbolId, BufferSize> _bufferSymbols{};
+        size_t _head = 0;
+        size_t _count = 0;
+    };
+
+    // inputs smaller than this are lexed on the calling thread
+    constexpr size_t ParallelLexThreshold = 1u << 20u;
+
+    struct LexedRange
+    {
+        TokenBuffer tokens;
+        // Lexer::Position() once the range is done
+        size_t end = 0;
+    };
+
+    LexedRange LexRange(std::string_view str, size_t begin, size_t end)
+    {
+        LexedRange range;
+        Lexer lexer(str, begin, end);
+        while (!lexer.AtEnd())
+        {
+            range.tokens.PushBack(lexer.Peek());
+            lexer.Next();
+        }
+        range.end = lexer.Position();
+        return range;
+    }
+
+    // The whole token stream at once, for dumping and for ParseSource to cut
+    // at declarations and hand to the parsers. Parse pulls from a Lexer.
+    //
+    // Large inputs are cut just after newlines into one chunk per thread, and
+    // every chunk is lexed as if no token from the previous one ran into it.
+    // Comments end at the newline, so only a string literal can. When one
+    // does, the chunk is lexed again from where the literal ended until a
+    // token lines up with a speculative one, the rest is taken as is.
+    // Identifiers are not interned here, so the threads share nothing.
+    TokenBuffer Tokenize(std::string_view str,
+                         unsigned threads = std::thread::hardware_concurrency())
+    {
+        if (threads < 2 || str.size() < ParallelLexThreshold)
+        {
+            return std::move(LexRange(str, 0, str.size()).tokens);
+        }
+        std::vector<size_t> bounds = {0};
+        for (size_t k = 1; k < threads; ++k)
+        {
+            auto target = std::max(bounds.back(), str.size() / threads * k);
+            auto cut = FindChar(str, '\n', target);
+            if (cut >= str.size())
+            {
+                break;
+            }
+            bounds.push_back(cut + 1);
+        }
+        bounds.push_back(str.size());
+
+        auto chunkCount = bounds.size() - 1;
+        std::vector<LexedRange> chunks(chunkCount);
+        std::vector<std::thread> workers;
+        for (size_t k = 1; k < chunkCount; ++k)
+        {
+            workers.emplace_back([&, k]
+                                 {
+                                     chunks[k] = LexRange(str, bounds[k],
+                                                          bounds[k + 1]);
+                                 });
+        }
+        chunks[0] = LexRange(str, bounds[0], bounds[1]);
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        auto tokens = std::move(chunks[0].tokens);
+        auto pos = chunks[0].end;
+        for (size_t k = 1; k < chunkCount; ++k)
+        {
+            auto &chunk = chunks[k].tokens;
+            size_t first = 0;
+            if (pos > bounds[k])
+            {
+                // a token of the previous chunk ran into this one
+                first = chunk.Size();
+                Lexer lexer(str, pos, bounds[k + 1]);
+                while (!lexer.AtEnd())
+                {
+                    auto token = lexer.Peek();
+                    auto same = chunk.LowerBound(token.GetOffset());
+                    // an identical token ends at the same place, from there
+                    // on the speculative tokens are right
+                    if (same < chunk.Size() && chunk[same] == token)
+                    {
+                        first = same;
+                        break;
+                    }
+                    tokens.PushBack(token);
+                    lexer.Next();
+                }
+                if (first == chunk.Size())
+                {
+                    // still out of step, carry on into the next chunk
+                    pos = lexer.Position();
+                    continue;
                 }
             }
+            tokens.Append(chunk, first);
+            pos = chunks[k].end;
         }
         return tokens;
     }
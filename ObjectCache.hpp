@@ -0,0 +1,172 @@
+//
+// On-disk cache of compiled objects.
+//
+
+#ifndef INTERPRETER_OBJECTCACHE_HPP
+#define INTERPRETER_OBJECTCACHE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Target/TargetMachine.h"
+
+namespace In
+{
+    // Objects compiled from modules, one file each named after the hash of
+    // the optimized module's IR and the target machine it was compiled for:
+    // triple, CPU, features and optimization level. Used by the JIT's
+    // compiler and the object file alike, a hit skips the backend. Prune()
+    // drops the least recently used once the objects outgrow their size.
+    class ObjectCache : public llvm::ObjectCache
+    {
+    public:
+        ObjectCache(std::string directory,
+                    const llvm::TargetMachine &targetMachine,
+                    uint64_t maxSize) :
+                _directory(std::move(directory)), _maxSize(maxSize)
+        {
+            llvm::raw_string_ostream os(_target);
+            os << targetMachine.getTargetTriple().str() << "\n"
+               << targetMachine.getTargetCPU() << "\n"
+               << targetMachine.getTargetFeatureString() << "\n"
+               << static_cast<int>(targetMachine.getOptLevel()) << "\n";
+            os.flush();
+        }
+
+        // null on a miss
+        std::unique_ptr<llvm::MemoryBuffer> getObject(
+                const llvm::Module *module) override
+        {
+            auto key = Key(*module);
+            auto path = Path(key);
+            auto buffer = llvm::MemoryBuffer::getFile(path);
+            if (!buffer)
+            {
+                // the compile that follows a miss stores under the same key
+                _missed = {this, module, key};
+                return nullptr;
+            }
+            // pruning goes by access time, which the file system may not
+            // keep up to date on a read
+            int fd;
+            if (!llvm::sys::fs::openFileForWrite(
+                    path, fd, llvm::sys::fs::CD_OpenExisting,
+                    llvm::sys::fs::OF_Append))
+            {
+                llvm::sys::fs::setLastAccessAndModificationTime(
+                        fd, std::chrono::system_clock::now());
+                llvm::sys::fs::closeFile(fd);
+            }
+            return std::move(*buffer);
+        }
+
+        // Written to a temporary file renamed into place, so a compile that
+        // runs at the same time never reads a half written one. A cache that
+        // can't be written only costs the next compile the backend.
+        void notifyObjectCompiled(const llvm::Module *module,
+                                  llvm::MemoryBufferRef object) override
+        {
+            auto key = TakeMissedKey(module);
+            if (auto ec = llvm::sys::fs::create_directories(_directory))
+            {
+                Warn(ec.message());
+                return;
+            }
+            auto file = llvm::sys::fs::TempFile::create(
+                    _directory + "/object-%%%%%%%%.tmp");
+            if (!file)
+            {
+                Warn(llvm::toString(file.takeError()));
+                return;
+            }
+            {
+                llvm::raw_fd_ostream os(file->FD, false);
+                os << object.getBuffer();
+            }
+            if (auto error = file->keep(Path(key)))
+            {
+                Warn(llvm::toString(std::move(error)));
+                llvm::consumeError(file->discard());
+            }
+        }
+
+        // once a compile is done, not after every object
+        void Prune() const
+        {
+            llvm::CachePruningPolicy policy;
+            policy.Interval = std::chrono::seconds(0);
+            policy.MaxSizeBytes = _maxSize;
+            llvm::pruneCache(_directory, policy);
+        }
+
+    private:
+        // Printing the module is most of the cost of a key, don't do it
+        // twice. Only a miss leads to a compile, and it runs on the thread
+        // that missed before that thread looks up anything else. So a miss
+        // left behind by a failed compile is replaced by the next one, before
+        // a module allocated at the same address could take its key.
+        uint64_t TakeMissedKey(const llvm::Module *module)
+        {
+            auto missed = std::exchange(_missed, Missed{});
+            if (missed.cache == this && missed.module == module)
+            {
+                return missed.key;
+            }
+            return Key(*module);
+        }
+
+        uint64_t Key(const llvm::Module &module) const
+        {
+            std::string text = _target;
+            llvm::raw_string_ostream os(text);
+            module.print(os, nullptr);
+            os.flush();
+            return llvm::xxHash64(text);
+        }
+
+        // pruning only looks at files with this prefix, the ASTs kept in the
+        // same directory are left alone
+        std::string Path(uint64_t key) const
+        {
+            std::string path;
+            llvm::raw_string_ostream os(path);
+            os << _directory << "/llvmcache-"
+               << llvm::format_hex_no_prefix(key, 16) << ".o";
+            return os.str();
+        }
+
+        void Warn(const std::string &message) const
+        {
+            llvm::errs() << "warning: can't write object cache in "
+                         << _directory << ": " << message << "\n";
+        }
+
+        std::string _directory;
+        // what the target machine adds to the key
+        std::string _target;
+        uint64_t _maxSize;
+
+        struct Missed
+        {
+            const ObjectCache *cache;
+            const llvm::Module *module;
+            uint64_t key;
+        };
+
+        // the last module getObject missed on this thread, zeroed until then
+        static inline thread_local Missed _missed{};
+    };
+}
+
+#endif //INTERPRETER_OBJECTCACHE_HPP
@@ -0,0 +1,231 @@
+//
+// Operator table shared by the parser, the AST and codegen.
+//
+
+#ifndef INTERPRETER_OPERATOR_HPP
+#define INTERPRETER_OPERATOR_HPP
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <string_view>
+
+#include "Lexer.hpp"
+
+namespace In
+{
+    // what an operator does, independent of how it is spelled
+    enum Opcode : uint8_t
+    {
+        OpNone,
+        // binary
+        OpAssign,
+        OpOr,
+        OpAnd,
+        OpBitOr,
+        OpBitAnd,
+        OpEqual,
+        OpNotEqual,
+        OpLess,
+        OpGreater,
+        OpLessEqual,
+        OpGreaterEqual,
+        OpAdd,
+        OpSub,
+        OpMul,
+        OpDiv,
+        OpRem,
+        // unary
+        OpNeg,
+        OpBitNot,
+        OpNot,
+        OpcodeCount
+    };
+
+    struct Operator
+    {
+        enum Associativity : uint8_t
+        {
+            Left,
+            Right
+        };
+
+        Token::Kind kind;
+        uint8_t arity;
+        // higher binds tighter, 0 is not an operator
+        uint8_t precedence;
+        Associativity associativity;
+        Opcode opcode;
+        std::string_view spelling;
+    };
+
+    // every operator the parser accepts, prefix operators bind tighter than
+    // any binary one
+    constexpr std::array<Operator, 19> operators = {{
+            {Token::Assign, 2, 1, Operator::Right, OpAssign, "="},
+            {Token::OrOr, 2, 2, Operator::Left, OpOr, "||"},
+            {Token::AndAnd, 2, 3, Operator::Left, OpAnd, "&&"},
+            {Token::Or, 2, 4, Operator::Left, OpBitOr, "|"},
+            {Token::And, 2, 5, Operator::Left, OpBitAnd, "&"},
+            {Token::EqualEqual, 2, 6, Operator::Left, OpEqual, "=="},
+            {Token::NotEqual, 2, 6, Operator::Left, OpNotEqual, "!="},
+            {Token::Less, 2, 7, Operator::Left, OpLess, "<"},
+            {Token::Greater, 2, 7, Operator::Left, OpGreater, ">"},
+            {Token::LessEqual, 2, 7, Operator::Left, OpLessEqual, "<="},
+            {Token::GreaterEqual, 2, 7, Operator::Left, OpGreaterEqual, ">="},
+            {Token::Plus, 2, 8, Operator::Left, OpAdd, "+"},
+            {Token::Minus, 2, 8, Operator::Left, OpSub, "-"},
+            {Token::Star, 2, 9, Operator::Left, OpMul, "*"},
+            {Token::Slash, 2, 9, Operator::Left, OpDiv, "/"},
+            {Token::Percent, 2, 9, Operator::Left, OpRem, "%"},
+            {Token::Minus, 1, 10, Operator::Right, OpNeg, "-"},
+            {Token::Tilde, 1, 10, Operator::Right, OpBitNot, "~"},
+            {Token::Not, 1, 10, Operator::Right, OpNot, "!"}}};
+
+    // operators indexed by token kind, one table per arity
+    constexpr std::array<Operator, 256> MakeOperatorTable(uint8_t arity)
+    {
+        std::array<Operator, 256> table{};
+        for (auto &op : operators)
+        {
+            if (op.arity == arity)
+            {
+                table[op.kind] = op;
+            }
+        }
+        return table;
+    }
+
+    inline constexpr std::array<Operator, 256> binaryOperators =
+            MakeOperatorTable(2);
+    inline constexpr std::array<Operator, 256> unaryOperators =
+            MakeOperatorTable(1);
+
+    constexpr std::array<Operator, OpcodeCount> MakeOpcodeTable()
+    {
+        std::array<Operator, OpcodeCount> table{};
+        for (auto &op : operators)
+        {
+            table[op.opcode] = op;
+        }
+        return table;
+    }
+
+    inline constexpr std::array<Operator, OpcodeCount> opcodeOperators =
+            MakeOpcodeTable();
+
+    static_assert(binaryOperators[Token::Minus].opcode == OpSub);
+    static_assert(unaryOperators[Token::Minus].opcode == OpNeg);
+    static_assert(opcodeOperators[OpRem].spelling == "%");
+
+    // precedence 0 when kind is not a binary operator
+    const Operator &BinaryOperator(Token::Kind kind)
+    {
+        return binaryOperators[kind];
+    }
+
+    const Operator &UnaryOperator(Token::Kind kind)
+    {
+        return unaryOperators[kind];
+    }
+
+    bool IsUnaryOp(Token::Kind kind)
+    {
+        return unaryOperators[kind].opcode != OpNone;
+    }
+
+    const Operator &OpcodeOperator(Opcode opcode)
+    {
+        return opcodeOperators[opcode];
+    }
+
+    // whether a binary operand has to be printed in parentheses to keep the
+    // tree's shape, like the right side of a - (b - c)
+    bool NeedsParens(Opcode parent, Opcode operand, bool right)
+    {
+        auto &op = opcodeOperators[parent];
+        auto precedence = opcodeOperators[operand].precedence;
+        bool against = right == (op.associativity == Operator::Left);
+        return precedence < op.precedence ||
+               (precedence == op.precedence && against);
+    }
+
+    // Evaluate an operator on constants the way the generated code would,
+    // false when it can't be folded. Comparisons are left alone, codegen
+    // gives them a different type than their operands.
+    bool FoldBinary(Opcode opcode, float l, float r, float &result)
+    {
+        switch (opcode)
+        {
+            case OpAdd:
+                result = l + r;
+                return true;
+            case OpSub:
+                result = l - r;
+                return true;
+            case OpMul:
+                result = l * r;
+                return true;
+            case OpDiv:
+                result = l / r;
+                return true;
+            case OpRem:
+                result = std::fmod(l, r);
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool FoldUnary(Opcode opcode, float v, float &result)
+    {
+        if (opcode == OpNeg)
+        {
+            result = -v;
+            return true;
+        }
+        return false;
+    }
+
+    // ints wrap around like the i32 code does, a division that would trap
+    // is left for run time
+    bool FoldBinary(Opcode opcode, int32_t l, int32_t r, int32_t &result)
+    {
+        auto wrap = [](int64_t v)
+        { return static_cast<int32_t>(static_cast<uint32_t>(v)); };
+        switch (opcode)
+        {
+            case OpAdd:
+                result = wrap(int64_t(l) + r);
+                return true;
+            case OpSub:
+                result = wrap(int64_t(l) - r);
+                return true;
+            case OpMul:
+                result = wrap(int64_t(l) * r);
+                return true;
+            case OpDiv:
+            case OpRem:
+                if (r == 0 || (l == INT32_MIN && r == -1))
+                {
+                    return false;
+                }
+                result = opcode == OpDiv ? l / r : l % r;
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool FoldUnary(Opcode opcode, int32_t v, int32_t &result)
+    {
+        if (opcode == OpNeg)
+        {
+            result = static_cast<int32_t>(0u - static_cast<uint32_t>(v));
+            return true;
+        }
+        return false;
+    }
+}
+
+#endif //INTERPRETER_OPERATOR_HPP
@@ -5,114 +5,93 @@
 #ifndef INTERPRETER_PARSE_HPP
 #define INTERPRETER_PARSE_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <iostream>
-#include <map>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
-#include <variant>
 
 #include "Lexer.hpp"
 #include "AST.hpp"
+#include "Diagnostic.hpp"
+#include "Operator.hpp"
+#include "Scope.hpp"
 
 namespace In
 {
-    class SymbolTable
+    class Parse
     {
     public:
-        enum ValKind
-        {
-            Static,
-            Argument,
-            Normal
-        };
-
-        enum ValType
+        // tokens are pulled from the source while parsing, it has to outlive
+        // the parser and the AST. Nodes are allocated in arena and live as
+        // long as it does.
+        Parse(std::string_view source, AstArena &arena) :
+                Parse(source, 0, source.size(), arena)
         {
-            Int,
-            Float,
-        };
+        }
 
-        struct Val
+        // only the declarations starting in [begin, end) of source
+        Parse(std::string_view source, size_t begin, size_t end,
+              AstArena &arena) :
+                _lexer(source, begin, end, &TheSymbols), _arena(arena)
         {
-            ValKind kind;
-            ValType type;
-            std::variant<std::string, int, float> val;
-        };
+            _currToken = &_lexer.Peek();
+        }
 
-        SymbolTable(std::map<std::string, Val> parent = {}) :
-                _symbolTable(std::move(parent))
+        // tokens [first, last) of tokens, lexed from source beforehand
+        Parse(std::string_view source, const TokenBuffer &tokens, size_t first,
+              size_t last, AstArena &arena) :
+                _lexer(source, tokens, first, last, &TheSymbols), _arena(arena)
         {
+            _currToken = &_lexer.Peek();
         }
 
-        bool SetValue(const std::string &name, ValKind kind, ValType type, const std::string &value)
+        // functions in source order, nothing is generated yet. A declaration
+        // with an error is reported to GetDiagnostics() and left out.
+        std::vector<Function *> ParseProgram()
         {
-            auto oldVal = _symbolTable.find(name);
-            if (oldVal != _symbolTable.end())
+            std::vector<Function *> functions;
+            while (!_lexer.AtEnd())
             {
-                // TODO:find in parent
-                if (oldVal->second.kind == kind && oldVal->second.type == type)
+                try
                 {
-                    oldVal->second.val = value;
-                    return true;
+                    if (auto *function = ParseGlobalDeclaration())
+                    {
+                        functions.push_back(function);
+                    }
+                }
+                catch (const ParseError &)
+                {
+                    Synchronize(true);
                 }
             }
-            return false;
-        }
-
-        bool Define(const std::string &name, ValKind kind, ValType type, const std::string &value)
-        {
-            if (_symbolTable.find(name) == _symbolTable.end())
-            {
-                _symbolTable[name] = Val{kind, type, value};
-                return true;
-            }
-            return false;
-        }
-
-    private:
-        std::map<std::string, Val> _symbolTable;
-    };
-
-    class Parse
-    {
-    public:
-        Parse(std::vector<Token> tokens)
-        {
-            _tokens = std::move(tokens);
-            _currToken = _tokens.begin();
+            return functions;
         }
 
-        void ParseProgram()
-        { ParseGlobalDeclaration(); }
+        Diagnostics &GetDiagnostics()
+        { return _diagnostics; }
 
-        void ParseGlobalDeclaration()
+        // null for a global variable
+        Function *ParseGlobalDeclaration()
         {
             // 3 is (    int a ( | int a = | int *a
             // if ((_currToken + 3)->GetValue() == "(")
-            if (LookN(2)->GetValue() == "(")
+            if (LookN(2)->GetKind() == Token::LParen)
             {
-                auto function = ParseFunctionDeclaration();
-                std::cout << function.ToStr() << std::endl;
-                function.codegen();
+                return ParseFunctionDeclaration();
             }
             // int a = | int * a =
-            else if (LookN(2)->GetValue() == "=" || LookN(3)->GetValue() == "=")
-            {
-                ParseAssign();
-                MatchValue(";");
-            }
-            else
-            {
-                Boom();
-            }
-
-            if (_currToken == _tokens.end())
+            if (LookN(2)->GetKind() == Token::Assign ||
+                LookN(3)->GetKind() == Token::Assign)
             {
-                return;
+                ParseAssign(false);
+                MatchKind(Token::Semicolon);
+                return nullptr;
             }
-
-            ParseGlobalDeclaration();
+            Expected("a function or variable declaration");
         }
 
         // TODO:declaration * int *a, int b
@@ -121,358 +100,456 @@ namespace In
             std::vector<std::pair<Type, Identifier>> params;
             do
             {
-                auto type = MatchValueConditionRet(IsTypeKeyWord);
-                auto identifier = MatchTypeRetValue(Token::Identifier);
+                auto kind = _currToken->GetKind();
+                auto type = MatchKindConditionRet(IsTypeKeyWord, "a type");
+                auto offset = _currToken->GetOffset();
+                auto identifier = MatchIdentifier();
+                Declare(identifier, kind, offset);
                 params.emplace_back(Type(type), Identifier(identifier));
-            } while (MatchLookValue(","));
-            return Param(params);
+            } while (MatchLookKind(Token::Comma));
+            return Param(_arena.Copy(params));
         }
 
-        std::shared_ptr<Statement> ParseReturn()
+        Statement *ParseReturn()
         {
-            if (MatchLookValue("return"))
+            if (MatchLookKind(Token::KwReturn))
             {
                 // TODO:syntax check, compare return val with return type
-                if (MatchLookValue(";"))
+                if (MatchLookKind(Token::Semicolon))
                 {
                     // TODO: use nullptr?
-                    return std::make_shared<Statement>();
+                    return _arena.New<Statement>();
                 }
                 auto expression = ParseExpression();
-                MatchValue(";");
-                return std::make_shared<Return>(expression);
+                MatchKind(Token::Semicolon);
+                return _arena.New<Return>(expression);
             }
-            return std::make_shared<Statement>();
+            return _arena.New<Statement>();
         }
 
-        std::shared_ptr<Statement> ParseFunctionBody()
+        Block *ParseFunctionBody()
         {
-            return ParseStatement();
+            return ParseBlock();
         }
 
-        Function ParseFunctionDeclaration()
+        Function *ParseFunctionDeclaration()
         {
-            auto returnType = _currToken->GetValue();
-            MatchValueCondition(IsTypeKeyWord);
-            auto identifier = MatchTypeRetValue(Token::Identifier);
-            MatchValue("(");
+            auto returnType = Text(*_currToken);
+            MatchKindCondition(IsTypeKeyWord, "a type");
+            auto identifier = MatchIdentifier();
+            MatchKind(Token::LParen);
+            // parameters are in the scope around the body
+            _scope.Clear();
+            auto scope = _scope.Scope();
             Param param;
-            if (_currToken->GetValue() != ")")
+            if (_currToken->GetKind() != Token::RParen)
             {
                 param = ParseParameterDeclaration();
             }
-            MatchValue(")");
-            MatchValue("{");
+            MatchKind(Token::RParen);
+            MatchKind(Token::LBrace);
             auto body = ParseFunctionBody();
-            MatchValue("}");
+            MatchKind(Token::RBrace);
             // TODO:statement
-            return Function(Type(returnType), Identifier(identifier), param, body);
+            return _arena.New<Function>(Type(returnType), Identifier(identifier),
+                                        param, body);
         }
 
-        std::shared_ptr<Assign> ParseAssign()
+        // a global when declare is false, they are not in scope of functions
+        Assign *ParseAssign(bool declare = true)
         {
             // TODO:static
-            auto type = MatchTypeRetValue(Token::KeyWord);
-            auto identifier = MatchTypeRetValue(Token::Identifier);
-            MatchValue("=");
+            auto kind = _currToken->GetKind();
+            auto type = MatchKindConditionRet(IsTypeKeyWord, "a type");
+            auto offset = _currToken->GetOffset();
+            auto identifier = MatchIdentifier();
+            MatchKind(Token::Assign);
+            // int a = a; reads an outer a
             auto expr = ParseExpression();
-            return std::make_shared<Assign>(Identifier(identifier), expr);
+            if (declare)
+            {
+                Declare(identifier, kind, offset);
+            }
+            return _arena.New<Assign>(Type(type), Identifier(identifier),
+                                      expr);
         }
 
         Args ParseCallArgs()
         {
             // TODO: *a
-            std::vector<std::shared_ptr<Expression>> args;
+            std::vector<Expression *> args;
             while (true)
             {
                 auto arg = ParseExpression();
                 args.push_back(arg);
-                if (!MatchLookValue(","))
+                if (!MatchLookKind(Token::Comma))
                 {
-                    MatchValue(")");
+                    MatchKind(Token::RParen);
                     break;
                 }
             }
-            return args;
+            return Args(_arena.Copy(args));
         }
 
-        std::shared_ptr<Expression> ParseTerm()
+        Expression *ParseTerm()
         {
             // TODO:(1 * 2)
             switch (_currToken->GetType())
             {
                 case Token::NumLiteral:
                 {
+                    auto offset = _currToken->GetOffset();
                     auto num = MatchTypeRetValue(Token::NumLiteral);
-                    return std::make_shared<NumberLiteral>(num);
+                    if (num.find('.') != std::string_view::npos)
+                    {
+                        float value;
+                        auto [end, error] = std::from_chars(
+                                num.data(), num.data() + num.size(), value);
+                        if (error != std::errc())
+                        {
+                            Error(offset,
+                                  "float literal is out of range for float");
+                        }
+                        return _arena.New<NumberLiteral>(value);
+                    }
+                    int32_t value;
+                    auto [end, error] = std::from_chars(
+                            num.data(), num.data() + num.size(), value);
+                    if (error != std::errc())
+                    {
+                        Error(offset, "integer literal is too large for int");
+                    }
+                    return _arena.New<NumberLiteral>(value);
                 }
                 case Token::Char:
                 {
                     auto c = MatchTypeRetValue(Token::Char);
-                    return std::make_shared<StringLiteral>(c);
+                    return _arena.New<StringLiteral>(c);
                 }
                 case Token::StringLiteral:
                 {
                     auto s = MatchTypeRetValue(Token::StringLiteral);
-                    return std::make_shared<StringLiteral>(s);
+                    return _arena.New<StringLiteral>(s);
                 }
                 case Token::Identifier:
                 {
-                    auto identifier = MatchTypeRetValue(Token::Identifier);
+                    auto offset = _currToken->GetOffset();
+                    auto identifier = MatchIdentifier();
                     // call
-                    if (MatchLookValue("("))
+                    if (MatchLookKind(Token::LParen))
                     {
                         auto args = ParseCallArgs();
-                        return std::make_shared<Call>(Identifier(identifier), args);
+                        return _arena.New<Call>(Identifier(identifier), args);
                     }
-                    return std::make_shared<Identifier>(identifier);
                     // else is a var
+                    Use(identifier, offset);
+                    return _arena.New<Identifier>(identifier);
                 }
                 case Token::KeyWord:
                 {
-                    if (_currToken->GetValue() == "true" || _currToken->GetValue() == "false")
-                    {
-                        return std::make_shared<BoolLiteral>(MatchTypeRetValue(Token::KeyWord));
-                    }
-                    else
+                    if (_currToken->GetKind() == Token::KwTrue ||
+                        _currToken->GetKind() == Token::KwFalse)
                     {
-                        Boom();
+                        return _arena.New<BoolLiteral>(
+                                MatchTypeRetValue(Token::KeyWord));
                     }
+                    Expected("an expression");
                     // op term
                 }
                 case Token::Operator:
                 {
-                    auto c = _currToken->GetValue()[0];
-                    if (!IsUnaryOp(c))
+                    if (!IsUnaryOp(_currToken->GetKind()))
                     {
-                        Boom();
+                        Expected("an expression");
                     }
-                    auto val = ParseTerm();
-                    return std::make_shared<UnaryOp>(std::string(1, c), val);
+                    // prefix operators bind tighter than any binary one
+                    auto op = UnaryOperator(_currToken->GetKind()).opcode;
+                    Next();
+                    return MakeUnary(op, ParseTerm());
+                }
+                case Token::Symbol:
+                {
+                    if (_currToken->GetKind() != Token::LParen)
+                    {
+                        Expected("an expression");
+                    }
+                    MatchKind(Token::LParen);
+                    auto expr = ParseExpression();
+                    MatchKind(Token::RParen);
+                    return expr;
                 }
                 default:
-                    Boom();
+                    Expected("an expression");
             }
         }
 
-        std::shared_ptr<Expression> ParseExpression()
+        // Precedence climbing: operands of an operator are parsed at one level
+        // above its precedence, or at the same level when it is right
+        // associative, so tighter operators end up deeper in the tree.
+        Expression *ParseExpression(uint8_t minPrecedence = 1)
         {
             auto left = ParseTerm();
-            // TODO:is operator
             while (_currToken->GetType() == Token::Operator)
             {
-                auto op = MatchTypeRetValue(Token::Operator);
-                auto right = ParseTerm();
-
-                left = std::make_shared<BinaryOp>(op, left, right);
+                auto &op = BinaryOperator(_currToken->GetKind());
+                if (op.precedence == 0 || op.precedence < minPrecedence)
+                {
+                    break;
+                }
+                Next();
+                auto next = op.associativity == Operator::Right
+                            ? op.precedence : op.precedence + 1;
+                auto right = ParseExpression(next);
+                left = MakeBinary(op.opcode, left, right);
             }
             return left;
         }
 
-        std::shared_ptr<Statement> ParseStatement()
+        // operators on number literals are folded into one literal
+        Expression *MakeBinary(Opcode op, Expression *left, Expression *right)
         {
-            // TODO:{  { int a = 0; }  }
-            // null statement
-            if (MatchLookValue(";"))
+            auto *l = dynamic_cast<NumberLiteral *>(left);
+            auto *r = dynamic_cast<NumberLiteral *>(right);
+            if (l && r && l->_integer && r->_integer)
             {
-                std::make_shared<EmptyStatement>();
-            }
-            // call function | assign var | set var val
-
-            // TODO: search from symbol table
-            // int a = 1;
-            auto stmt = std::make_shared<Statement>();
-            if (IsTypeKeyWord(_currToken->GetValue()))
-            {
-                stmt->SetLeft(std::make_shared<Statement>(ParseAssign()));
-                MatchValue(";");
+                int32_t value;
+                if (FoldBinary(op, l->_int, r->_int, value))
+                {
+                    return _arena.New<NumberLiteral>(value);
+                }
             }
-            else if (_currToken->GetType() == Token::Identifier &&
-                     ((LookN(1)->GetValue() == "(") || (LookN(1)->GetValue() == "=")))
+            else if (l && r)
             {
-                auto identifier = MatchTypeRetValue(Token::Identifier);
-                // fun(args..);
-                if (MatchLookValue("("))
+                float value;
+                if (FoldBinary(op, l->Float(), r->Float(), value))
                 {
-                    // a, b, 1
-                    auto args = ParseCallArgs();
-                    stmt->SetLeft(std::make_shared<Statement>(std::make_shared<Call>(Identifier(identifier), args)));
+                    return _arena.New<NumberLiteral>(value);
                 }
-                    // a = 1;
-                else
+            }
+            return _arena.New<BinaryOp>(op, left, right);
+        }
+
+        Expression *MakeUnary(Opcode op, Expression *val)
+        {
+            auto *v = dynamic_cast<NumberLiteral *>(val);
+            if (v && v->_integer)
+            {
+                int32_t value;
+                if (FoldUnary(op, v->_int, value))
                 {
-                    MatchValue("=");
-                    auto expr = ParseExpression();
-                    stmt->SetLeft(std::make_shared<Statement>(std::make_shared<SetNewVal>(Identifier(identifier), expr)));
+                    return _arena.New<NumberLiteral>(value);
                 }
-                MatchValue(";");
             }
-            else
+            else if (v)
             {
-                if (MatchLookValue("if"))
+                float value;
+                if (FoldUnary(op, v->_val, value))
                 {
-                    stmt->SetLeft(ParseIf());
+                    return _arena.New<NumberLiteral>(value);
                 }
-                else if (MatchLookValue("for"))
+            }
+            return _arena.New<UnaryOp>(op, val);
+        }
+
+        // statements up to the closing '}', which is left to the caller
+        Block *ParseBlock()
+        {
+            auto scope = _scope.Scope();
+            std::vector<Statement *> stmts;
+            while (_currToken->GetKind() != Token::RBrace && !_lexer.AtEnd())
+            {
+                // null statement
+                if (MatchLookKind(Token::Semicolon))
                 {
-                    stmt->SetLeft(ParseFor());
+                    continue;
                 }
-                else if (MatchLookValue("while"))
+                try
                 {
-                    stmt->SetLeft(ParseWhile());
+                    stmts.push_back(ParseStatement());
                 }
-                    // stop recursion
-                else if (_currToken->GetValue() == "return")
+                catch (const ParseError &)
                 {
-                    // return ParseReturn();
-                    stmt->SetLeft(ParseReturn());
+                    Synchronize(false);
                 }
-                else if (_currToken->GetValue() == "}")
+            }
+            return _arena.New<Block>(_arena.Copy(stmts));
+        }
+
+        // a braced block or a single statement
+        Statement *ParseBody()
+        {
+            if (MatchLookKind(Token::LBrace))
+            {
+                auto *block = ParseBlock();
+                MatchKind(Token::RBrace);
+                return block;
+            }
+            return ParseStatement();
+        }
+
+        Statement *ParseStatement()
+        {
+            // TODO:{  { int a = 0; }  }
+            // call function | assign var | set var val
+
+            // int a = 1;
+            if (IsTypeKeyWord(_currToken->GetKind()))
+            {
+                auto stmt = _arena.New<Statement>(ParseAssign());
+                MatchKind(Token::Semicolon);
+                return stmt;
+            }
+            if (_currToken->GetType() == Token::Identifier &&
+                (LookN(1)->GetKind() == Token::LParen ||
+                 LookN(1)->GetKind() == Token::Assign))
+            {
+                auto offset = _currToken->GetOffset();
+                auto identifier = MatchIdentifier();
+                Statement *stmt;
+                // fun(args..);
+                if (MatchLookKind(Token::LParen))
                 {
-                    return std::make_shared<EmptyStatement>();
+                    // a, b, 1
+                    auto args = ParseCallArgs();
+                    stmt = _arena.New<Statement>(
+                            _arena.New<Call>(Identifier(identifier), args));
                 }
+                    // a = 1;
                 else
                 {
-                    // expression;
-                    stmt->SetExpr(ParseExpression());
-                    MatchValue(";");
+                    Use(identifier, offset);
+                    MatchKind(Token::Assign);
+                    auto expr = ParseExpression();
+                    stmt = _arena.New<Statement>(_arena.New<SetNewVal>(
+                            Identifier(identifier), expr));
                 }
+                MatchKind(Token::Semicolon);
+                return stmt;
             }
-            stmt->SetRight(ParseStatement());
+            if (MatchLookKind(Token::KwIf))
+            {
+                return ParseIf();
+            }
+            if (MatchLookKind(Token::KwFor))
+            {
+                return ParseFor();
+            }
+            if (MatchLookKind(Token::KwWhile))
+            {
+                return ParseWhile();
+            }
+            if (_currToken->GetKind() == Token::KwReturn)
+            {
+                return ParseReturn();
+            }
+            // expression;
+            auto stmt = _arena.New<Statement>(ParseExpression());
+            MatchKind(Token::Semicolon);
             return stmt;
         }
 
         void ParseDeclaration()
         {
             // TODO: pointer, multi value, for example: int *a, b, c;
-            auto type = MatchValueConditionRet(IsTypeKeyWord);
-            auto identifier = MatchTypeRetValue(Token::Identifier);
-            MatchValue("=");
+            auto type = MatchKindConditionRet(IsTypeKeyWord, "a type");
+            auto identifier = MatchIdentifier();
+            MatchKind(Token::Assign);
             ParseExpression();
         }
 
-        std::shared_ptr<If> ParseIf()
+        If *ParseIf()
         {
-            MatchValue("(");
+            MatchKind(Token::LParen);
             auto test = ParseExpression();
-            MatchValue(")");
-            std::shared_ptr<Statement> conseq;
-            if (MatchLookValue("{"))
-            {
-                conseq = ParseStatement();
-                MatchValue("}");
-            }
-            else
+            MatchKind(Token::RParen);
+            auto conseq = ParseBody();
+            Statement *alt = nullptr;
+            if (MatchLookKind(Token::KwElse))
             {
-                conseq = ParseStatement();
+                alt = ParseBody();
             }
-            std::shared_ptr<Statement> alt;
-            if (MatchLookValue("else"))
-            {
-                if (MatchLookValue("{"))
-                {
-                    alt = ParseStatement();
-                    MatchValue("}");
-                }
-            }
-            return std::make_shared<If>(test, conseq, alt);
+            return _arena.New<If>(test, conseq, alt);
         }
 
-        std::shared_ptr<While> ParseWhile()
+        While *ParseWhile()
         {
-            MatchValue("(");
+            MatchKind(Token::LParen);
             ParseExpression();
-            MatchValue(")");
-            if (MatchLookValue("{"))
-            {
-                ParseStatement();
-                MatchValue("}");
-            }
-            else
-            {
-                ParseStatement();
-            }
+            MatchKind(Token::RParen);
+            ParseBody();
+            // TODO:codegen
+            return _arena.New<While>();
         }
 
-        std::shared_ptr<For> ParseFor()
+        For *ParseFor()
         {
-            MatchValue("(");
+            MatchKind(Token::LParen);
+            // the loop variable is only in scope of the loop
+            auto scope = _scope.Scope();
             // assign int a = 0;
             auto assign = ParseAssign();
-            MatchValue(";");
+            MatchKind(Token::Semicolon);
             auto condition = ParseExpression();
-            MatchValue(";");
+            MatchKind(Token::Semicolon);
             auto step = ParseExpression();
-            MatchValue(")");
-            std::shared_ptr<Statement> body;
-            if (MatchLookValue("{"))
-            {
-                body = ParseStatement();
-                MatchValue("}");
-            }
-            else
-            {
-                // TODO: parse on line
-                body = ParseStatement();
-            }
-            return std::make_shared<For>(assign, condition, step, body);
+            MatchKind(Token::RParen);
+            auto body = ParseBody();
+            return _arena.New<For>(assign, condition, step, body);
         }
 
         void Next()
         {
-            ++_currToken;
+            _lexer.Next();
+            _currToken = &_lexer.Peek();
         }
 
         template<typename Condition>
-        std::string MatchValueConditionRet(Condition &&condition)
+        std::string_view MatchKindConditionRet(Condition &&condition,
+                                               std::string_view what)
         {
-            auto v = _currToken->GetValue();
-            MatchValueCondition(condition);
-            return v;
-        }
-
-        std::string MatchValueRet(const std::string &s)
-        {
-            auto v = _currToken->GetValue();
-            MatchValue(s);
+            auto v = Text(*_currToken);
+            MatchKindCondition(condition, what);
             return v;
         }
 
         template<typename Condition>
-        void MatchValueCondition(Condition &&condition)
+        void MatchKindCondition(Condition &&condition, std::string_view what)
         {
-            if (!condition(_currToken->GetValue()))
+            if (!condition(_currToken->GetKind()))
             {
-                Boom();
+                Expected(what);
             }
-            ++_currToken;
+            Next();
         }
 
-        void MatchValue(const std::string &s)
+        void MatchKind(Token::Kind kind)
         {
-            MatchValueCondition([&](auto &&v)
-                                {
-                                    return v == s;
-                                });
-            //        if(_currToken->GetValue() != s)
-            //        {
-            //            Boom();
-            //        }
-            //        ++_currToken;
+            if (_currToken->GetKind() != kind)
+            {
+                Expected("'" + std::string(KindSpelling(kind)) + "'");
+            }
+            Next();
         }
 
-        std::string MatchTypeRetValue(Token::Type type)
+        std::string_view MatchTypeRetValue(Token::Type type)
         {
-            auto v = _currToken->GetValue();
+            auto v = Text(*_currToken);
             MatchType(type);
             return v;
         }
 
-        bool MatchLookValue(const std::string &s)
+        SymbolId MatchIdentifier()
         {
-            if (_currToken->GetValue() == s)
+            auto id = _lexer.PeekSymbol();
+            MatchType(Token::Identifier);
+            return id;
+        }
+
+        bool MatchLookKind(Token::Kind kind)
+        {
+            if (_currToken->GetKind() == kind)
             {
-                ++_currToken;
+                Next();
                 return true;
             }
             return false;
@@ -482,32 +559,256 @@ namespace In
         {
             if (_currToken->GetType() != type)
             {
-                Boom();
+                Expected(TypeToStr(type));
             }
-            ++_currToken;
+            Next();
         }
 
         bool MatchLookType(Token::Type type)
         {
             if (_currToken->GetType() == type)
             {
-                ++_currToken;
+                Next();
                 return true;
             }
             return false;
         }
 
-        std::vector<Token>::iterator LookN(size_t n)
+        std::string_view Text(Token token) const
+        {
+            return _lexer.Text(token);
+        }
+
+        const Token *LookN(size_t n)
         {
-            return _currToken + n;
+            return &_lexer.Peek(n);
         }
 
     private:
-        std::vector<Token> _tokens;
+        // unwinds to the enclosing statement or declaration after an error
+        struct ParseError
+        {
+        };
+
+        // report an error at the current token and abandon what is parsed
+        [[noreturn]] void Error(std::string message)
+        {
+            Error(_currToken->GetOffset(), std::move(message));
+        }
+
+        [[noreturn]] void Error(size_t offset, std::string message)
+        {
+            _diagnostics.Error(offset, std::move(message));
+            throw ParseError();
+        }
+
+        [[noreturn]] void Expected(std::string_view what)
+        {
+            if (_currToken->GetType() == Token::End)
+            {
+                Error("expected " + std::string(what) + " before end of input");
+            }
+            Error("expected " + std::string(what) + " but found '" +
+                  std::string(Text(*_currToken)) + "'");
+        }
+
+        // a local declared at offset, once per scope
+        void Declare(SymbolId name, Token::Kind type, size_t offset)
+        {
+            if (type == Token::KwVoid)
+            {
+                Error(offset, "variable '" +
+                              std::string(TheSymbols.Name(name)) +
+                              "' declared void");
+            }
+            if (!_scope.Define(name, type))
+            {
+                Error(offset, "redefinition of '" +
+                              std::string(TheSymbols.Name(name)) + "'");
+            }
+        }
+
+        // there are no globals in functions yet, every name has to be local
+        void Use(SymbolId name, size_t offset)
+        {
+            if (_scope.Lookup(name) == nullptr)
+            {
+                Error(offset, "use of undeclared identifier '" +
+                              std::string(TheSymbols.Name(name)) + "'");
+            }
+        }
+
+        // Skip what is left of a statement after an error: through the next
+        // ';' or a braced body that closes, but not an else that follows it.
+        // Inside a block a '}' closing the block is left for ParseBlock, at
+        // the top level a stray one is dropped.
+        void Synchronize(bool topLevel)
+        {
+            size_t depth = 0;
+            while (!_lexer.AtEnd())
+            {
+                auto kind = _currToken->GetKind();
+                if (kind == Token::RBrace && depth == 0)
+                {
+                    if (topLevel)
+                    {
+                        Next();
+                    }
+                    return;
+                }
+                Next();
+                if (kind == Token::LBrace)
+                {
+                    ++depth;
+                }
+                else if (kind == Token::RBrace && --depth == 0 &&
+                         _currToken->GetKind() != Token::KwElse)
+                {
+                    return;
+                }
+                else if (kind == Token::Semicolon && depth == 0)
+                {
+                    return;
+                }
+            }
+        }
+
+        Lexer _lexer;
+
+        AstArena &_arena;
+
+        // the front of the lexer's lookahead window, valid until Next()
+        const Token *_currToken;
 
-        std::vector<Token>::iterator _currToken;
+        // the declared type of each local in scope
+        ScopedSymbolTable<Token::Kind> _scope;
+
+        Diagnostics _diagnostics;
+    };
+
+    // inputs smaller than this are parsed on the calling thread
+    constexpr size_t ParallelParseThreshold = 1u << 20u;
+
+    // Offsets of the tokens that start top-level declarations. Braces are
+    // matched over the token kinds alone, a declaration ends at a ';' or a
+    // '}' that is outside any braces. open, when given, is set to whether the
+    // last declaration is still open at the end of tokens.
+    std::vector<size_t> DeclarationStarts(const TokenBuffer &tokens,
+                                          bool *open = nullptr)
+    {
+        std::vector<size_t> starts;
+        auto &kinds = tokens.Kinds();
+        size_t depth = 0;
+        bool inside = false;
+        for (size_t i = 0; i < kinds.size(); ++i)
+        {
+            if (!inside)
+            {
+                starts.push_back(tokens[i].GetOffset());
+                inside = true;
+            }
+            switch (kinds[i])
+            {
+                case Token::LBrace:
+                    ++depth;
+                    break;
+                case Token::RBrace:
+                    // a stray '}' is left to the parser to report
+                    if (depth > 0 && --depth == 0)
+                    {
+                        inside = false;
+                    }
+                    break;
+                case Token::Semicolon:
+                    inside = depth != 0;
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (open != nullptr)
+        {
+            *open = inside;
+        }
+        return starts;
+    }
 
-        SymbolTable _symbolTable;
+    struct ParsedSource
+    {
+        // own the nodes of functions, one per chunk parsed
+        std::vector<AstArena> arenas;
+        std::vector<Function *> functions;
+        Diagnostics diagnostics;
     };
+
+    // Parse a whole source. Large inputs are lexed once to find where the
+    // top-level declarations start, cut there into a few chunks per thread
+    // and the chunks are parsed concurrently from those tokens, each into its
+    // own arena.
+    // Functions come back in source order either way.
+    ParsedSource ParseSource(std::string_view source,
+                             unsigned threads =
+                                     std::thread::hardware_concurrency())
+    {
+        ParsedSource parsed;
+        if (threads < 2 || source.size() < ParallelParseThreshold)
+        {
+            parsed.arenas.resize(1);
+            Parse parse(source, parsed.arenas[0]);
+            parsed.functions = parse.ParseProgram();
+            parsed.diagnostics = std::move(parse.GetDiagnostics());
+            return parsed;
+        }
+        auto tokens = Tokenize(source, threads);
+        auto starts = DeclarationStarts(tokens);
+        // more chunks than threads, functions differ in size
+        std::vector<size_t> bounds = {0};
+        size_t chunkCount = std::min<size_t>(threads * 4, starts.size());
+        for (size_t k = 1; k < chunkCount; ++k)
+        {
+            auto target = source.size() / chunkCount * k;
+            auto cut = std::lower_bound(starts.begin(), starts.end(), target);
+            if (cut != starts.end() && *cut > bounds.back())
+            {
+                bounds.push_back(*cut);
+            }
+        }
+        bounds.push_back(source.size());
+
+        chunkCount = bounds.size() - 1;
+        parsed.arenas.resize(chunkCount);
+        std::vector<std::vector<Function *>> chunks(chunkCount);
+        std::vector<Diagnostics> diagnostics(chunkCount);
+        std::atomic<size_t> next = 0;
+        auto work = [&]
+        {
+            for (size_t k = next++; k < chunkCount; k = next++)
+            {
+                Parse parse(source, tokens, tokens.LowerBound(bounds[k]),
+                            tokens.LowerBound(bounds[k + 1]),
+                            parsed.arenas[k]);
+                chunks[k] = parse.ParseProgram();
+                diagnostics[k] = std::move(parse.GetDiagnostics());
+            }
+        };
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t)
+        {
+            workers.emplace_back(work);
+        }
+        work();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+
+        for (size_t k = 0; k < chunkCount; ++k)
+        {
+            parsed.functions.insert(parsed.functions.end(), chunks[k].begin(),
+                                    chunks[k].end());
+            parsed.diagnostics.Append(std::move(diagnostics[k]));
+        }
+        return parsed;
+    }
 }
 #endif // INTERPRETER_PARSE_HPP
@@ -0,0 +1,176 @@
+//
+// Names in nested scopes.
+//
+
+#ifndef INTERPRETER_SCOPE_HPP
+#define INTERPRETER_SCOPE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "Symbol.hpp"
+
+namespace In
+{
+    // Bindings of interned names, innermost scope first, shared by the
+    // parser and codegen with their own Entry. An open addressing hash maps
+    // a name to its innermost binding, and each binding remembers the one it
+    // shadows, so a lookup is one probe sequence however deep the scopes and
+    // large the function. Leaving a scope only touches the bindings made in
+    // it, Clear() is constant time.
+    template<typename Entry>
+    class ScopedSymbolTable
+    {
+    public:
+        // pops the scope it pushed when it goes out of scope, also when
+        // parsing unwinds past it
+        class ScopeGuard
+        {
+        public:
+            explicit ScopeGuard(ScopedSymbolTable &table) : _table(table)
+            {
+                _table.PushScope();
+            }
+
+            ScopeGuard(const ScopeGuard &) = delete;
+
+            ScopeGuard &operator=(const ScopeGuard &) = delete;
+
+            ~ScopeGuard()
+            {
+                _table.PopScope();
+            }
+
+        private:
+            ScopedSymbolTable &_table;
+        };
+
+        [[nodiscard]] ScopeGuard Scope()
+        { return ScopeGuard(*this); }
+
+        void PushScope()
+        {
+            _scopes.push_back(static_cast<uint32_t>(_bindings.size()));
+        }
+
+        void PopScope()
+        {
+            auto first = _scopes.back();
+            _scopes.pop_back();
+            while (_bindings.size() > first)
+            {
+                auto &binding = _bindings.back();
+                _slots[Find(binding.name)].binding = binding.shadowed;
+                _bindings.pop_back();
+            }
+        }
+
+        // Bind name in the innermost scope. False when it already was bound
+        // there, that binding is replaced.
+        bool Define(SymbolId name, Entry entry)
+        {
+            if ((_used + 1) * 2 > _slots.size())
+            {
+                Grow();
+            }
+            auto &slot = _slots[Find(name)];
+            if (slot.generation != _generation)
+            {
+                slot = {name, NoBinding, _generation};
+                ++_used;
+            }
+            auto scope = _scopes.empty() ? 0 : _scopes.back();
+            if (slot.binding != NoBinding && slot.binding >= scope)
+            {
+                _bindings[slot.binding].entry = entry;
+                return false;
+            }
+            _bindings.push_back({name, slot.binding, entry});
+            slot.binding = static_cast<uint32_t>(_bindings.size() - 1);
+            return true;
+        }
+
+        // the innermost binding of name, null when there is none
+        Entry *Lookup(SymbolId name)
+        {
+            if (_slots.empty())
+            {
+                return nullptr;
+            }
+            auto &slot = _slots[Find(name)];
+            if (slot.generation != _generation || slot.binding == NoBinding)
+            {
+                return nullptr;
+            }
+            return &_bindings[slot.binding].entry;
+        }
+
+        // drop every scope and binding, for the next function
+        void Clear()
+        {
+            _bindings.clear();
+            _scopes.clear();
+            _used = 0;
+            // slots of older generations read as empty
+            if (++_generation == 0)
+            {
+                _slots.assign(_slots.size(), Slot());
+                _generation = 1;
+            }
+        }
+
+    private:
+        static constexpr uint32_t NoBinding = UINT32_MAX;
+
+        struct Slot
+        {
+            SymbolId name = 0;
+            uint32_t binding = NoBinding;
+            uint32_t generation = 0;
+        };
+
+        struct Binding
+        {
+            SymbolId name;
+            uint32_t shadowed;
+            Entry entry;
+        };
+
+        // the slot of name, or the empty one it would go in
+        size_t Find(SymbolId name) const
+        {
+            auto mask = _slots.size() - 1;
+            // symbols are numbered densely, spread them with a multiply
+            auto i = (name * 0x9E3779B9u) & mask;
+            while (_slots[i].generation == _generation &&
+                   _slots[i].name != name)
+            {
+                i = (i + 1) & mask;
+            }
+            return i;
+        }
+
+        void Grow()
+        {
+            auto old = std::move(_slots);
+            _slots.assign(old.empty() ? 64 : old.size() * 2, Slot());
+            for (auto &slot : old)
+            {
+                if (slot.generation == _generation)
+                {
+                    _slots[Find(slot.name)] = slot;
+                }
+            }
+        }
+
+        std::vector<Slot> _slots;
+        std::vector<Binding> _bindings;
+        // index of the first binding of each open scope
+        std::vector<uint32_t> _scopes;
+        uint32_t _generation = 1;
+        // slots in use in this generation
+        size_t _used = 0;
+    };
+}
+
+#endif //INTERPRETER_SCOPE_HPP
@@ -0,0 +1,102 @@
+//
+// Interned identifiers.
+//
+
+#ifndef INTERPRETER_SYMBOL_HPP
+#define INTERPRETER_SYMBOL_HPP
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace In
+{
+    using SymbolId = uint32_t;
+
+    // Maps each distinct identifier to a dense id, so later stages compare and
+    // index names as integers. The lexer interns every identifier it produces.
+    // Lexers on several threads share one pool, each through a SymbolCache, so
+    // the pool only sees a name once per lexer. Most of those find a name that
+    // is already there and only take the lock shared.
+    class SymbolPool
+    {
+    public:
+        SymbolId Intern(std::string_view name)
+        {
+            {
+                std::shared_lock lock(_mutex);
+                auto found = _ids.find(name);
+                if (found != _ids.end())
+                {
+                    return found->second;
+                }
+            }
+            std::unique_lock lock(_mutex);
+            // another thread may have added it in between
+            auto found = _ids.find(name);
+            if (found != _ids.end())
+            {
+                return found->second;
+            }
+            // the pool keeps its own copy, ids outlive the source buffers
+            auto &saved = _names.emplace_back(name);
+            auto id = static_cast<SymbolId>(_names.size() - 1);
+            _ids.emplace(saved, id);
+            return id;
+        }
+
+        [[nodiscard]] std::string_view Name(SymbolId id) const
+        {
+            std::shared_lock lock(_mutex);
+            return _names[id];
+        }
+
+        [[nodiscard]] size_t Size() const
+        {
+            std::shared_lock lock(_mutex);
+            return _names.size();
+        }
+
+    private:
+        mutable std::shared_mutex _mutex;
+        // deque, so growing does not move the strings the keys view into
+        std::deque<std::string> _names;
+        std::unordered_map<std::string_view, SymbolId> _ids;
+    };
+
+    // A lexer's own table in front of the shared pool. Identifiers repeat a
+    // lot, only the first of each name takes the pool's lock.
+    class SymbolCache
+    {
+    public:
+        explicit SymbolCache(SymbolPool &pool) : _pool(pool)
+        {
+        }
+
+        // the keys view into name, it has to outlive the cache
+        SymbolId Intern(std::string_view name)
+        {
+            auto found = _ids.find(name);
+            if (found != _ids.end())
+            {
+                return found->second;
+            }
+            auto id = _pool.Intern(name);
+            _ids.emplace(name, id);
+            return id;
+        }
+
+    private:
+        SymbolPool &_pool;
+        std::unordered_map<std::string_view, SymbolId> _ids;
+    };
+
+    // one pool for the process, ids stay the same across compilations
+    static inline SymbolPool TheSymbols;
+}
+
+#endif //INTERPRETER_SYMBOL_HPP
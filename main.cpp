@@ -1,16 +1,107 @@
+#include <atomic>
+#include <chrono>
 #include <iostream>
-#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "AstCache.hpp"
+#include "FlatAST.hpp"
+#include "Incremental.hpp"
+#include "ObjectCache.hpp"
 #include "Parse.hpp"
 
-std::string ReadFile(const std::string &fileName)
+static llvm::cl::list<std::string> InputFilenames(
+        llvm::cl::Positional, llvm::cl::desc("<input files>"),
+        llvm::cl::ZeroOrMore);
+
+static llvm::cl::opt<bool> DumpTokens(
+        "dump-tokens", llvm::cl::desc("Print the token stream of each input"));
+
+static llvm::cl::opt<bool> DumpAst(
+        "dump-ast", llvm::cl::desc("Print the AST of each function"));
+
+static llvm::cl::opt<bool> UseFlatAst(
+        "flat-ast", llvm::cl::desc("Generate code from the flat AST"));
+
+static llvm::cl::opt<std::string> CacheDir(
+        "cache-dir",
+        llvm::cl::desc("Cache parsed sources and compiled objects in <dir> "
+                       "and reuse them while they are unchanged, implies "
+                       "-flat-ast"),
+        llvm::cl::value_desc("dir"));
+
+static llvm::cl::opt<unsigned> CacheSize(
+        "cache-size",
+        llvm::cl::desc("Drop the least recently used objects from the cache "
+                       "once they take more than <mb> megabytes"),
+        llvm::cl::value_desc("mb"), llvm::cl::init(512));
+
+static llvm::cl::opt<bool> Watch(
+        "watch",
+        llvm::cl::desc("Recompile the functions that changed whenever an "
+                       "input is saved"));
+
+static llvm::cl::opt<bool> WatchEmit(
+        "watch-emit",
+        llvm::cl::desc("With -watch, also write output.o after every save, "
+                       "which optimizes and compiles the whole module"));
+
+static llvm::cl::opt<bool> Run(
+        "run",
+        llvm::cl::desc("JIT the program and run its main in process, its "
+                       "value is the exit code, instead of writing output.o"));
+
+static llvm::cl::opt<unsigned> Speculate(
+        "speculate",
+        llvm::cl::desc("With -run, compile the functions main can reach on "
+                       "<n> background threads while it runs"),
+        llvm::cl::value_desc("n"), llvm::cl::init(0));
+
+static llvm::cl::opt<unsigned> JitThreads(
+        "jit-threads",
+        llvm::cl::desc("With -run, compile on <n> threads, the program cut "
+                       "into as many modules on contexts of their own, and "
+                       "report what each thread compiled"),
+        llvm::cl::value_desc("n"), llvm::cl::init(0));
+
+static llvm::cl::opt<char> OptLevel(
+        "O",
+        llvm::cl::desc("Optimization level: -O0, -O1, -O2, -O3 or -Os "
+                       "(default -O0)"),
+        llvm::cl::Prefix, llvm::cl::ZeroOrMore, llvm::cl::init('0'));
+
+static llvm::cl::opt<unsigned> Threads(
+        "j", llvm::cl::desc("Threads used to lex and parse large inputs"),
+        llvm::cl::init(std::thread::hardware_concurrency()));
+
+// Regular files are mapped with mmap and lexed in place, pipes and "-" (stdin)
+// fall back to a streaming read. The buffer is null terminated, which keeps
+// the lexer's one byte lookahead in bounds at the end of the file. Token
+// offsets are 32 bits, larger files are refused.
+std::unique_ptr<llvm::MemoryBuffer> ReadFile(const std::string &fileName)
 {
-    std::ifstream file(fileName, std::ios::in);
-    if (!file.is_open())
+    auto buffer = llvm::MemoryBuffer::getFileOrSTDIN(fileName);
+    if (std::error_code ec = buffer.getError())
     {
-        return "";
+        llvm::errs() << "Could not open file: " << fileName << ": "
+                     << ec.message() << "\n";
+        return nullptr;
     }
-    return std::string((std::istreambuf_iterator<char>(file)),
-                         std::istreambuf_iterator<char>());
+    if ((*buffer)->getBufferSize() > In::MaxSourceSize)
+    {
+        llvm::errs() << "File too large: " << fileName << ": "
+                     << (*buffer)->getBufferSize()
+                     << " bytes, the limit is 4 GiB\n";
+        return nullptr;
+    }
+    return std::move(*buffer);
 }
 
 void LLVMTargetInit()
@@ -21,7 +112,57 @@ void LLVMTargetInit()
     llvm::InitializeAllAsmParsers();
     llvm::InitializeAllAsmPrinters();
 }
-void OutPutObj(const std::string& objName = "output.o")
+// Run the standard module pipeline of the -O level, which inlines and
+// optimizes across functions, on a module that is about to be emitted.
+void OptimizeModule(llvm::Module &module, llvm::TargetMachine *targetMachine)
+{
+    llvm::PassBuilder::OptimizationLevel level;
+    switch (OptLevel)
+    {
+        case '0':
+            return;
+        case '1':
+            level = llvm::PassBuilder::OptimizationLevel::O1;
+            break;
+        case '2':
+            level = llvm::PassBuilder::OptimizationLevel::O2;
+            break;
+        case '3':
+            level = llvm::PassBuilder::OptimizationLevel::O3;
+            break;
+        default:
+            level = llvm::PassBuilder::OptimizationLevel::Os;
+            break;
+    }
+    llvm::LoopAnalysisManager lam;
+    llvm::FunctionAnalysisManager fam;
+    llvm::CGSCCAnalysisManager cgam;
+    llvm::ModuleAnalysisManager mam;
+    llvm::PassBuilder builder(targetMachine);
+    builder.registerModuleAnalyses(mam);
+    builder.registerCGSCCAnalyses(cgam);
+    builder.registerFunctionAnalyses(fam);
+    builder.registerLoopAnalyses(lam);
+    builder.crossRegisterProxies(lam, fam, cgam, mam);
+    builder.buildPerModuleDefaultPipeline(level).run(module, mam);
+}
+
+llvm::CodeGenOpt::Level CodeGenOptLevel()
+{
+    switch (OptLevel)
+    {
+        case '0':
+            return llvm::CodeGenOpt::None;
+        case '1':
+            return llvm::CodeGenOpt::Less;
+        case '3':
+            return llvm::CodeGenOpt::Aggressive;
+        default:
+            return llvm::CodeGenOpt::Default;
+    }
+}
+
+void OutPutObj(llvm::Module &module, const std::string& objName = "output.o")
 {
     auto TargetTriple = llvm::sys::getDefaultTargetTriple();
     std::string Error;
@@ -40,9 +181,12 @@ void OutPutObj(const std::string& objName = "output.o")
 
     llvm::TargetOptions opt;
     auto RM = llvm::Optional<llvm::Reloc::Model>();
-    auto TargetMachine = Target->createTargetMachine(TargetTriple, CPU, Features, opt, RM);
-    In::TheModule->setDataLayout(TargetMachine->createDataLayout());
-    In::TheModule->setTargetTriple(TargetTriple);
+    auto TargetMachine = Target->createTargetMachine(
+            TargetTriple, CPU, Features, opt, RM, llvm::None,
+            CodeGenOptLevel());
+    module.setDataLayout(TargetMachine->createDataLayout());
+    module.setTargetTriple(TargetTriple);
+    OptimizeModule(module, TargetMachine);
 
     auto Filename = objName;
     std::error_code EC;
@@ -52,32 +196,553 @@ void OutPutObj(const std::string& objName = "output.o")
         llvm::errs() << "Could not open file: " << EC.message();
         return;
     }
+
+    std::optional<In::ObjectCache> cache;
+    if (!CacheDir.empty())
+    {
+        cache.emplace(CacheDir, *TargetMachine, uint64_t(CacheSize) << 20);
+        if (auto object = cache->getObject(&module))
+        {
+            dest << object->getBuffer();
+            cache->Prune();
+            return;
+        }
+    }
+
+    // emitted to memory, the cache keeps a copy
+    llvm::SmallVector<char, 0> object;
+    llvm::raw_svector_ostream os(object);
     llvm::legacy::PassManager pass;
     auto FileType = llvm::CGFT_ObjectFile;
 
-    if (TargetMachine->addPassesToEmitFile(pass, dest, nullptr, FileType)) {
+    if (TargetMachine->addPassesToEmitFile(pass, os, nullptr, FileType)) {
         llvm::errs() << "TargetMachine can't emit a file of this type";
         return;
     }
 
-    pass.run(*In::TheModule);
+    pass.run(module);
+    llvm::StringRef bytes(object.data(), object.size());
+    dest << bytes;
     dest.flush();
+    if (cache)
+    {
+        cache->notifyObjectCompiled(&module, {bytes, Filename});
+        cache->Prune();
+    }
+}
+// The functions main can reach, nearest first, as the static call graph has
+// them: each call node is a call instruction of the module.
+std::vector<std::string> SpeculationOrder(llvm::Module &module)
+{
+    std::vector<std::string> order;
+    llvm::SmallPtrSet<llvm::Function *, 32> seen;
+    seen.insert(module.getFunction("main"));
+    std::vector<llvm::Function *> queue(seen.begin(), seen.end());
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        for (auto &instruction : llvm::instructions(*queue[i]))
+        {
+            auto *call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+            auto *callee = call != nullptr ? call->getCalledFunction()
+                                           : nullptr;
+            if (callee != nullptr && !callee->empty() &&
+                seen.insert(callee).second)
+            {
+                queue.push_back(callee);
+                order.push_back(callee->getName().str());
+            }
+        }
+    }
+    return order;
+}
+
+// Every compile of the lazy JIT copies what is left of the module to a
+// context of its own. Taking the callees a function can reach along, up to
+// this many functions in all, keeps a program that calls most of its
+// functions from paying that once per function.
+constexpr size_t PartitionSize = 32;
+
+llvm::Optional<llvm::orc::CompileOnDemandLayer::GlobalValueSet> Partition(
+        llvm::orc::CompileOnDemandLayer::GlobalValueSet requested)
+{
+    std::vector<const llvm::GlobalValue *> queue(requested.begin(),
+                                                 requested.end());
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        auto *function = llvm::dyn_cast<llvm::Function>(queue[i]);
+        if (function == nullptr)
+        {
+            continue;
+        }
+        for (auto &instruction : llvm::instructions(*function))
+        {
+            auto *call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+            auto *callee = call != nullptr ? call->getCalledFunction()
+                                           : nullptr;
+            // the bodies compiled already are gone from the module
+            if (callee == nullptr || callee->isDeclaration())
+            {
+                continue;
+            }
+            if (requested.size() == PartitionSize)
+            {
+                return requested;
+            }
+            if (requested.insert(callee).second)
+            {
+                queue.push_back(callee);
+            }
+        }
+    }
+    return requested;
+}
+
+// Cut a module into parts of about as many functions each, on contexts of
+// their own, so the parts are taken apart and compiled at the same time on
+// different threads. A part keeps declarations of what it calls in others.
+std::vector<llvm::orc::ThreadSafeModule> SplitModule(
+        llvm::orc::ThreadSafeModule module, unsigned parts)
+{
+    llvm::DenseMap<const llvm::GlobalValue *, unsigned> partOf;
+    size_t functions = 0;
+    for (auto &function : *module.getModuleUnlocked())
+    {
+        functions += !function.isDeclaration();
+    }
+    for (auto &function : *module.getModuleUnlocked())
+    {
+        if (!function.isDeclaration())
+        {
+            partOf[&function] = partOf.size() * parts / functions;
+        }
+    }
+
+    std::vector<llvm::orc::ThreadSafeModule> split;
+    for (unsigned part = 0; part < parts; ++part)
+    {
+        split.push_back(llvm::orc::cloneToNewContext(
+                module, [&](const llvm::GlobalValue &value)
+                {
+                    auto found = partOf.find(&value);
+                    return found != partOf.end() && found->second == part;
+                }));
+        // every other function came along as a declaration
+        auto &clone = *split.back().getModuleUnlocked();
+        for (auto it = clone.begin(); it != clone.end();)
+        {
+            auto &function = *it++;
+            if (function.isDeclaration() && function.use_empty())
+            {
+                function.eraseFromParent();
+            }
+        }
+    }
+    return split;
+}
+
+// what a JIT compile thread did, reported after the program ran
+struct CompileStats
+{
+    unsigned modules = 0;
+    unsigned functions = 0;
+    std::chrono::steady_clock::duration time{};
+};
+
+// a compile starts and ends on the same thread
+thread_local std::chrono::steady_clock::time_point CompileStart;
+
+// Hand the module to an ORC LLLazyJIT, optimized like an object file would
+// be, and call main. Its value, converted to int, is the exit code. Functions
+// are compiled when they are first called, or ahead of that by -speculate
+// threads.
+int RunModule(In::CodegenSession &session)
+{
+    auto *mainFunction = session.Module().getFunction("main");
+    if (mainFunction == nullptr || mainFunction->empty())
+    {
+        llvm::errs() << "no main function to run\n";
+        return 1;
+    }
+    if (!mainFunction->arg_empty())
+    {
+        llvm::errs() << "main can't take parameters\n";
+        return 1;
+    }
+    // the JIT frees the module once it is compiled, keep what main returns
+    auto *returnType = mainFunction->getReturnType();
+    auto returnKind = returnType->getTypeID();
+    auto returnBits = returnType->isIntegerTy()
+                      ? returnType->getIntegerBitWidth() : 0;
+
+    auto builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+    if (!builder)
+    {
+        llvm::errs() << llvm::toString(builder.takeError()) << "\n";
+        return 1;
+    }
+    builder->setCodeGenOptLevel(CodeGenOptLevel());
+    auto targetMachine = builder->createTargetMachine();
+    if (!targetMachine)
+    {
+        llvm::errs() << llvm::toString(targetMachine.takeError()) << "\n";
+        return 1;
+    }
+    session.Module().setDataLayout((*targetMachine)->createDataLayout());
+    session.Module().setTargetTriple(builder->getTargetTriple().str());
+    OptimizeModule(session.Module(), targetMachine->get());
+
+    auto order = Speculate > 0 ? SpeculationOrder(session.Module())
+                               : std::vector<std::string>();
+
+    // Speculation compiles on more than one thread, which needs a target
+    // machine per compile, take as many compile threads as speculators when
+    // there are none. Without either everything is compiled in place.
+    unsigned compileThreads = JitThreads > 0 ? JitThreads : Speculate;
+    std::mutex statsMutex;
+    std::map<std::thread::id, CompileStats> stats;
+    llvm::orc::LLLazyJITBuilder jitBuilder;
+    jitBuilder.setJITTargetMachineBuilder(std::move(*builder))
+            .setNumCompileThreads(compileThreads);
+    // the compiler of every partition looks in the cache first
+    std::optional<In::ObjectCache> cache;
+    if (!CacheDir.empty())
+    {
+        cache.emplace(CacheDir, **targetMachine, uint64_t(CacheSize) << 20);
+        jitBuilder.setCompileFunctionCreator(
+                [&](llvm::orc::JITTargetMachineBuilder machine)
+                        -> llvm::Expected<
+                                llvm::orc::IRCompileLayer::CompileFunction>
+                {
+                    return llvm::orc::ConcurrentIRCompiler(std::move(machine),
+                                                           &*cache);
+                });
+    }
+    auto jit = jitBuilder.create();
+    if (!jit)
+    {
+        llvm::errs() << llvm::toString(jit.takeError()) << "\n";
+        return 1;
+    }
+    (*jit)->setPartitionFunction(Partition);
+    if (JitThreads > 0)
+    {
+        // a partition reaches the compiler as a module of its own, and is
+        // an object file when it leaves
+        (*jit)->getIRTransformLayer().setTransform(
+                [&](llvm::orc::ThreadSafeModule module, auto &)
+                        -> llvm::Expected<llvm::orc::ThreadSafeModule>
+                {
+                    unsigned functions = 0;
+                    for (auto &function : *module.getModuleUnlocked())
+                    {
+                        functions += !function.isDeclaration();
+                    }
+                    std::lock_guard<std::mutex> lock(statsMutex);
+                    auto &threadStats = stats[std::this_thread::get_id()];
+                    ++threadStats.modules;
+                    threadStats.functions += functions;
+                    CompileStart = std::chrono::steady_clock::now();
+                    return module;
+                });
+        (*jit)->getObjTransformLayer().setTransform(
+                [&](std::unique_ptr<llvm::MemoryBuffer> object)
+                        -> llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+                {
+                    std::lock_guard<std::mutex> lock(statsMutex);
+                    stats[std::this_thread::get_id()].time +=
+                            std::chrono::steady_clock::now() - CompileStart;
+                    return object;
+                });
+    }
+    std::vector<llvm::orc::ThreadSafeModule> modules;
+    if (JitThreads > 1)
+    {
+        modules = SplitModule(session.TakeModule(), JitThreads);
+    }
+    else
+    {
+        modules.push_back(session.TakeModule());
+    }
+    for (auto &module : modules)
+    {
+        if (auto error = (*jit)->addLazyIRModule(std::move(module)))
+        {
+            llvm::errs() << llvm::toString(std::move(error)) << "\n";
+            return 1;
+        }
+    }
+    // only main's stub so far, its body is compiled when it is called
+    auto symbol = (*jit)->lookup("main");
+    if (!symbol)
+    {
+        llvm::errs() << llvm::toString(symbol.takeError()) << "\n";
+        return 1;
+    }
+
+    // The stubs of every function are in place now, their bodies are
+    // compiled out of a dylib of their own when first called. Looking one up
+    // there compiles it ahead of the call, and a call that gets there first
+    // waits for the same compile instead of starting another.
+    auto &executionSession = (*jit)->getExecutionSession();
+    // LLLazyJIT names that dylib after the main one, it doesn't hand it out
+    auto *bodies = executionSession.getJITDylibByName(
+            (*jit)->getMainJITDylib().getName() + ".impl");
+    if (Speculate > 0 && bodies == nullptr)
+    {
+        llvm::errs() << "warning: -speculate ignored: no dylib "
+                     << (*jit)->getMainJITDylib().getName()
+                     << ".impl to compile function bodies from\n";
+    }
+    std::atomic<size_t> next = 0;
+    std::atomic<bool> done = false;
+    std::vector<std::thread> speculators;
+    for (unsigned i = 0; bodies != nullptr && i < Speculate; ++i)
+    {
+        speculators.emplace_back([&]
+        {
+            for (size_t j; !done && (j = next++) < order.size();)
+            {
+                // a failure is reported again if the function is called
+                llvm::consumeError(executionSession.lookup(
+                        llvm::orc::makeJITDylibSearchOrder(bodies),
+                        (*jit)->mangleAndIntern(order[j])).takeError());
+            }
+        });
+    }
+
+    auto address = symbol->getAddress();
+    int exitCode = 0;
+    if (returnKind == llvm::Type::VoidTyID)
+    {
+        llvm::jitTargetAddressToFunction<void (*)()>(address)();
+    }
+    else if (returnKind == llvm::Type::FloatTyID)
+    {
+        exitCode = static_cast<int>(
+                llvm::jitTargetAddressToFunction<float (*)()>(address)());
+    }
+    else if (returnBits == 1)
+    {
+        // only the low bit of an i1 return is defined
+        exitCode = llvm::jitTargetAddressToFunction<uint8_t (*)()>(address)()
+                   & 1;
+    }
+    else if (returnBits == 8)
+    {
+        exitCode = llvm::jitTargetAddressToFunction<int8_t (*)()>(address)();
+    }
+    else
+    {
+        exitCode = llvm::jitTargetAddressToFunction<int32_t (*)()>(address)();
+    }
+
+    // what is left to speculate isn't needed any more
+    done = true;
+    for (auto &speculator : speculators)
+    {
+        speculator.join();
+    }
+    if (cache)
+    {
+        cache->Prune();
+    }
+
+    unsigned index = 0;
+    for (auto &[thread, threadStats] : stats)
+    {
+        std::chrono::duration<double, std::milli> time = threadStats.time;
+        llvm::errs() << "compile thread " << index++ << ": "
+                     << threadStats.modules << " modules, "
+                     << threadStats.functions << " functions in "
+                     << llvm::format("%.1f", time.count()) << " ms\n";
+    }
+    return exitCode;
+}
+
+// Compile the inputs, then poll their modification times and bring the
+// module up to date on every save, until interrupted. Writing the object
+// file costs a whole module pipeline and backend run however little changed,
+// so it only happens with -watch-emit.
+int WatchSources()
+{
+    LLVMTargetInit();
+    In::CodegenSession session;
+    if (OptLevel != '0')
+    {
+        session.EnableCleanup();
+    }
+    In::IncrementalBuild build(session, Threads);
+    std::vector<llvm::sys::TimePoint<>> modified(InputFilenames.size());
+    while (true)
+    {
+        std::vector<std::unique_ptr<llvm::MemoryBuffer>> buffers;
+        std::vector<In::SourceText> sources;
+        for (size_t i = 0; i < InputFilenames.size(); ++i)
+        {
+            llvm::sys::fs::file_status status;
+            if (!llvm::sys::fs::status(InputFilenames[i], status))
+            {
+                modified[i] = status.getLastModificationTime();
+            }
+            if (auto buffer = ReadFile(InputFilenames[i]))
+            {
+                sources.push_back({InputFilenames[i],
+                                   {buffer->getBufferStart(),
+                                    buffer->getBufferSize()}});
+                buffers.push_back(std::move(buffer));
+            }
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        In::IncrementalBuild::Stats stats;
+        if (sources.size() == InputFilenames.size() &&
+            build.Update(sources, stats))
+        {
+            std::chrono::duration<double, std::milli> elapsed =
+                    std::chrono::steady_clock::now() - start;
+            llvm::errs() << "parsed " << stats.parsed
+                         << " declarations, generated " << stats.generated
+                         << " of " << stats.functions << " functions in "
+                         << llvm::format("%.1f", elapsed.count()) << " ms\n";
+            if (WatchEmit)
+            {
+                // the module pipeline inlines across functions, optimize a
+                // copy so the session keeps bodies it can regenerate one by
+                // one
+                OutPutObj(*llvm::CloneModule(session.Module()));
+            }
+        }
+
+        // a save shows up as a new modification time on any input
+        for (bool changed = false; !changed;)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            for (size_t i = 0; i < InputFilenames.size(); ++i)
+            {
+                llvm::sys::fs::file_status status;
+                if (!llvm::sys::fs::status(InputFilenames[i], status) &&
+                    status.getLastModificationTime() != modified[i])
+                {
+                    changed = true;
+                }
+            }
+        }
+    }
 }
-int main()
+
+int main(int argc, char **argv)
 {
-    In::TheModule = std::make_unique<llvm::Module>("my cool jit", In::TheContext);
-    std::string s = ReadFile("../source.sp");
+    llvm::cl::ParseCommandLineOptions(argc, argv, "SpL compiler\n");
+    if (InputFilenames.empty())
+    {
+        InputFilenames.push_back("-");
+    }
 
-    auto tokens = In::Tokenize(s);
-    for (auto& token : tokens)
+    if (std::string_view("0123s").find(OptLevel) == std::string_view::npos)
+    {
+        llvm::errs() << "invalid optimization level -O" << OptLevel << "\n";
+        return 1;
+    }
+    if (Watch)
+    {
+        return WatchSources();
+    }
+    // tokens view into the mapped sources, keep them alive for the whole compile
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> sources;
+    // the trees of every file, their nodes live in the arenas kept here
+    std::vector<In::ParsedSource> programs;
+    std::optional<In::AstCache> cache;
+    if (!CacheDir.empty())
     {
-        token.Output();
+        cache.emplace(CacheDir);
     }
+    In::CodegenSession session;
+    if (OptLevel != '0')
+    {
+        session.EnableCleanup();
+    }
+    // keep going after a bad file so one run reports the errors of all of them
+    bool failed = false;
+    for (auto &fileName : InputFilenames)
+    {
+        auto source = ReadFile(fileName);
+        if (source == nullptr)
+        {
+            failed = true;
+            continue;
+        }
+        std::string_view text(source->getBufferStart(),
+                              source->getBufferSize());
+        if (DumpTokens)
+        {
+            auto tokens = In::Tokenize(text, Threads);
+            for (size_t i = 0; i < tokens.Size(); ++i)
+            {
+                In::DumpToken(std::cout, text, tokens[i]);
+            }
+        }
 
-     In::Parse p(tokens);
-     p.ParseProgram();
-     In::TheModule->print(llvm::errs(), nullptr);
+        // a cache hit skips lexing and parsing, the flat AST is mapped
+        In::FlatAst flat;
+        auto key = cache ? In::AstCache::Key(text) : 0;
+        if (!cache || !cache->Load(key, flat))
+        {
+            auto program = In::ParseSource(text, Threads);
+            if (program.diagnostics.HasErrors())
+            {
+                program.diagnostics.Print(llvm::errs(), fileName, text);
+                failed = true;
+                continue;
+            }
+            if (!UseFlatAst && !cache)
+            {
+                for (auto *function : program.functions)
+                {
+                    if (DumpAst)
+                    {
+                        function->Print(llvm::outs());
+                        llvm::outs() << "\n";
+                        llvm::outs().flush();
+                    }
+                    function->codegen(session);
+                }
+                sources.push_back(std::move(source));
+                programs.push_back(std::move(program));
+                continue;
+            }
+            for (auto *function : program.functions)
+            {
+                flat.Add(*function);
+            }
+            if (cache)
+            {
+                cache->Store(key, flat);
+            }
+        }
+        for (auto &function : flat.Functions())
+        {
+            if (DumpAst)
+            {
+                In::FlatPrinter(flat, llvm::outs()).Function(function);
+                // codegen still logs through std::cout
+                llvm::outs() << "\n";
+                llvm::outs().flush();
+            }
+            In::FlatCodegen(flat, session).Function(function);
+        }
+    }
+    session.Module().print(llvm::errs(), nullptr);
 
-     LLVMTargetInit();
-     OutPutObj();
+    // a module with errors left out is only good for the dump above
+    if (failed)
+    {
+        return 1;
+    }
+    LLVMTargetInit();
+    if (Run)
+    {
+        return RunModule(session);
+    }
+    OutPutObj(session.Module());
+    return 0;
 }